@@ -0,0 +1,14 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#define PROJECT "Stage"
+#define VERSION "4.0.1"
+#define APIVERSION "4.0"
+#define INSTALL_PREFIX "/usr/local"
+#define PLUGIN_PATH "/usr/local/lib64/Stage-4.0"
+
+/* #undef BUILD_GUI */
+/* #undef COUNT_ALLOCATIONS */
+
+#endif
+
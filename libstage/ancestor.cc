@@ -16,8 +16,9 @@ Ancestor::Ancestor() :
 
 Ancestor::~Ancestor()
 {
-  FOR_EACH( it, children )
-	 delete (*it);
+  // each child takes itself out of the list as it is deleted
+  while( children.size() )
+	 delete children.front();
 }
 
 void Ancestor::AddChild( Model* mod )
@@ -20,17 +20,53 @@ Block::Block( Model* mod,
   mod( mod ),
   mpts(),
   pts(pts),
+  rect_set(false),
   local_z( zmin, zmax ),
   color( color ),
   inherit_color( inherit_color ),
   wheel(wheel),
-  rendered_cells(), 
+  rendered_spans(), 
+  rendered_pts(),
   gpts()
 {
   assert( mod );
   canonicalize_winding(this->pts);
 }
 
+Block::Block( Model* mod,
+				  const std::vector<rotrect_t>& rects,
+				  meters_t zmin,
+				  meters_t zmax,
+				  Color color,
+				  bool inherit_color ) :
+  mod( mod ),
+  mpts(),
+  pts(),
+  rect_set(true),
+  local_z( zmin, zmax ),
+  color( color ),
+  inherit_color( inherit_color ),
+  wheel(false),
+  rendered_spans(), 
+  rendered_pts(),
+  gpts()
+{
+  assert( mod );
+
+  // the corners of each rectangle, wound anticlockwise
+  pts.reserve( 4 * rects.size() );
+  FOR_EACH( it, rects )
+	 {
+		const double x( it->pose.x ), y( it->pose.y );
+		const double w( it->size.x ), h( it->size.y );
+		
+		pts.push_back( point_t( x, y ) );
+		pts.push_back( point_t( x + w, y ) );
+		pts.push_back( point_t( x + w, y + h ) );
+		pts.push_back( point_t( x, y + h ) );
+	 }
+}
+
 /** A from-file  constructor */
 Block::Block(  Model* mod,
 					Worldfile* wf,
@@ -38,11 +74,13 @@ Block::Block(  Model* mod,
   : mod( mod ),
     mpts(),
     pts(),
+	 rect_set(false),
 	 local_z(),
     color(),
     inherit_color(true),
 	 wheel(),
-    rendered_cells(),
+    rendered_spans(),
+    rendered_pts(),
 	 gpts()
 {
   assert(mod);
@@ -59,6 +97,7 @@ Block::~Block()
 	 {
 		UnMap(0);
 		UnMap(1);
+		UnMap(STATIC_LAYER);
 	 }
 }
 
@@ -142,14 +181,19 @@ void Block::AppendTouchingModels( ModelPtrSet& touchers )
 {
   unsigned int layer = mod->world->updates % 2;
   
+  // static models can be touched too
+  const unsigned int layers[2] = { layer, STATIC_LAYER };
+  
   // for every cell we are rendered into
-  FOR_EACH( cell_it, rendered_cells[layer] )
-	 // for every block rendered into that cell
-	 FOR_EACH( block_it, (*cell_it)->GetBlocks(layer) )
-	 {
-		if( !mod->IsRelated( (*block_it)->mod ))
-		  touchers.insert( (*block_it)->mod );
-	 }
+  FOR_EACH( span_it, rendered_spans[ mod->mapped_static ? STATIC_LAYER : layer ] )
+	 for( Cell *c(span_it->start), *end(span_it->start + span_it->count); c != end; ++c )
+		for( unsigned int l(0); l<2; ++l )
+		  // for every block rendered into that cell
+		  FOR_EACH( block_it, c->GetBlocks(layers[l]) )
+			 {
+				if( !mod->IsRelated( (*block_it)->mod ))
+				  touchers.insert( (*block_it)->mod );
+			 }
 }
 
 Model* Block::TestCollision()
@@ -166,11 +210,34 @@ Model* Block::TestCollision()
 	  
 	 unsigned int layer = mod->world->updates % 2;
 
+	 // static models can be hit too
+	 const unsigned int layers[2] = { layer, STATIC_LAYER };
+
+	 const unsigned int own( mod->mapped_static ? STATIC_LAYER : layer );
+	 const unsigned int other( own == layer ? STATIC_LAYER : layer );
+
     // for every cell we may be rendered into
-	 FOR_EACH( cell_it, rendered_cells[layer] )
+	 FOR_EACH( span_it, rendered_spans[ own ] )
+		{
+		  // we are in every cell of the span, so if none of them holds
+		  // another block in our layer, or any in the other layer,
+		  // there's nothing to hit. Most collision tests are negative,
+		  // so check the region's bitmaps before touching the cells.
+		  const Region* reg( span_it->start->region );
+		  const int32_t i( span_it->start - reg->cells );
+		  const int32_t row( i >> RBITS );
+		  const uint32_t mask( (span_it->count < 32 ? 
+										(1U << span_it->count) - 1 : ~0U) << (i & CELLMASK) );
+		  
+		  if( !(reg->GetCrowding( own )[row] & mask) &&
+				!(reg->GetOccupancy( other )[row] & mask) )
+			 continue;
+		  
+		for( Cell *c(span_it->start), *end(span_it->start + span_it->count); c != end; ++c )
+		  for( unsigned int l(0); l<2; ++l )
       {
 		  // for every block rendered into that cell
-				FOR_EACH( block_it, (*cell_it)->GetBlocks(layer) )
+				FOR_EACH( block_it, c->GetBlocks(layers[l]) )
 			 {
 				Block* testblock = *block_it;
 				Model* testmod = testblock->mod;
@@ -190,6 +257,7 @@ Model* Block::TestCollision()
 				  }
 			 }
 		}
+		}
   }
 
   //printf( "model %s block %p collision done. no hits.\n", mod->Token(), this );
@@ -214,8 +282,22 @@ void Block::Map( unsigned int layer )
   gpts.clear();
   mod->LocalToPixels( mpts, gpts );
 	
-	// and render this block's polygon into the world
-	mod->world->MapPoly( gpts, this, layer );
+	// if we are already rendered into this layer and none of our
+	// vertices moved to another pixel, we cover exactly the same cells
+	// as before, so there's nothing to do. This is common for slow
+	// models at fine map resolutions.
+	if( rendered_spans[layer].empty() || gpts != rendered_pts[layer] )
+		{
+			if( ! rendered_spans[layer].empty() )
+				UnMap( layer );
+			
+			// render this block's polygon into the world
+			if( rect_set )
+				mod->world->MapPolys( gpts, 4, this, layer, mod->fill_blocks );
+			else
+				mod->world->MapPoly( gpts, this, layer, mod->fill_blocks );
+			rendered_pts[layer] = gpts;
+		}
 	
   // update the block's absolute z bounds at this rendering
   Pose gpose( mod->GetGlobalPose() );
@@ -233,17 +315,55 @@ void Block::Map( unsigned int layer )
 
 void Block::UnMap( unsigned int layer )
 {
-	//   std::for_each( rendered_cells.begin(), 
-	// 					  rendered_cells.end(), 
-	// 					  std::bind2nd( std::mem_fun(&Cell::RemoveBlock), this));
-  
-  FOR_EACH( it, rendered_cells[layer] )
-		(*it)->RemoveBlock(this, layer );
+  FOR_EACH( it, rendered_spans[layer] )
+	 for( Cell *c(it->start), *end(it->start + it->count); c != end; ++c )
+		c->RemoveBlock(this, layer );
   
-  rendered_cells[layer].clear();
+  rendered_spans[layer].clear();
+  rendered_pts[layer].clear();
   mapped = false;
 }
 
+bool Block::ExpandMoveBounds( unsigned int layer, 
+										const point_t& origin, 
+										double reach, 
+										double turn,
+										point_int_t& min, 
+										point_int_t& max )
+{
+  // the cells we are rendered into are within the box around our
+  // rendered vertices
+  if( rendered_pts[layer].empty() || mpts.empty() )
+	 return false;
+  
+  FOR_EACH( it, rendered_pts[layer] )
+	 {
+		min.x = std::min( min.x, it->x );
+		min.y = std::min( min.y, it->y );
+		max.x = std::max( max.x, it->x );
+		max.y = std::max( max.y, it->y );
+	 }
+  
+  // each of our vertices at the current pose can be carried by the
+  // translation, plus the turn around the origin. Map() refills gpts
+  // before using it, so borrow it instead of allocating.
+  gpts.clear();
+  mod->LocalToPixels( mpts, gpts );
+  
+  FOR_EACH( it, gpts )
+	 {
+		const double radius( hypot( it->x - origin.x, it->y - origin.y ) );
+		const int32_t margin( (int32_t)ceil( reach + radius * turn ) + 1 );
+		
+		min.x = std::min( min.x, it->x - margin );
+		min.y = std::min( min.y, it->y - margin );
+		max.x = std::max( max.x, it->x + margin );
+		max.y = std::max( max.y, it->y + margin );
+	 }
+  
+  return true;
+}
+
 inline point_t Block::BlockPointToModelMeters( const point_t& bpt )
 {
   Size bgsize = mod->blockgroup.GetSize();
@@ -275,12 +395,14 @@ void Block::Rasterize( uint8_t* data,
   //printf( "rasterize block %p : w: %u h: %u  scale %.2f %.2f  offset %.2f %.2f\n",
   //	 this, width, height, scalex, scaley, offsetx, offsety );
 	
-	const size_t pt_count = pts.size();
-  for( size_t i=0; i<pt_count; ++i )
+	const size_t pt_count = PolySize();
+  for( size_t i=0; i<pts.size(); ++i )
     {
-		// convert points from local to model coords
+		// convert points from local to model coords, joining each
+		// point to the next in its polygon
+		const size_t first( i - i % pt_count );
 		point_t mpt1 = BlockPointToModelMeters( pts[i] );
-		point_t mpt2 = BlockPointToModelMeters( pts[(i+1)%pt_count] );
+		point_t mpt2 = BlockPointToModelMeters( pts[first + (i+1-first)%pt_count] );
 	  
 		// record for debug visualization
 		mod->rastervis.AddPoint( mpt1.x, mpt1.y );
@@ -340,36 +462,51 @@ void Block::Rasterize( uint8_t* data,
 
 void Block::DrawTop()
 {
+  const size_t pt_count( PolySize() );
+  
   // draw the top of the block - a polygon at the highest vertical
   // extent
-  glBegin( GL_POLYGON);
-  FOR_EACH( it, pts )
-	 glVertex3f( it->x, it->y, local_z.max );
-  glEnd();
+  for( size_t first(0); pt_count && first < pts.size(); first += pt_count )
+	 {
+		glBegin( GL_POLYGON);
+		for( size_t i(first); i < first + pt_count; ++i )
+		  glVertex3f( pts[i].x, pts[i].y, local_z.max );
+		glEnd();
+	 }
 }
 
 void Block::DrawSides()
 {
-  // construct a strip that wraps around the polygon
-  glBegin(GL_QUAD_STRIP);
-
-  FOR_EACH( it, pts )
+  const size_t pt_count( PolySize() );
+  
+  for( size_t first(0); pt_count && first < pts.size(); first += pt_count )
 	 {
-      glVertex3f( it->x, it->y, local_z.max );
-      glVertex3f( it->x, it->y, local_z.min );
+		// construct a strip that wraps around the polygon
+		glBegin(GL_QUAD_STRIP);
+		
+		for( size_t i(first); i < first + pt_count; ++i )
+		  {
+			 glVertex3f( pts[i].x, pts[i].y, local_z.max );
+			 glVertex3f( pts[i].x, pts[i].y, local_z.min );
+		  }
+		// close the strip
+		glVertex3f( pts[first].x, pts[first].y, local_z.max );
+		glVertex3f( pts[first].x, pts[first].y, local_z.min );
+		glEnd();
 	 }
-  // close the strip
-  glVertex3f( pts[0].x, pts[0].y, local_z.max );
-  glVertex3f( pts[0].x, pts[0].y, local_z.min );
-  glEnd();
 }
 
 void Block::DrawFootPrint()
 {
-  glBegin(GL_POLYGON);	
-  FOR_EACH( it, pts )
-	 glVertex2f( it->x, it->y );
-  glEnd();
+  const size_t pt_count( PolySize() );
+  
+  for( size_t first(0); pt_count && first < pts.size(); first += pt_count )
+	 {
+		glBegin(GL_POLYGON);	
+		for( size_t i(first); i < first + pt_count; ++i )
+		  glVertex2f( pts[i].x, pts[i].y );
+		glEnd();
+	 }
 }
 
 void Block::DrawSolid( bool topview )
@@ -272,15 +272,48 @@ void BlockGroup::LoadBitmap( Model* mod, const std::string& bitmapfile, Worldfil
 	
 	std::vector<rotrect_t> rects;
   unsigned int width, height;
-  if( rotrects_from_image_file( full,
-																rects,
-																width, 
-																height ) )
-	{
-	  PRINT_ERR1( "failed to load rects from image file \"%s\"",
-								full.c_str() );
-	  return;
-	}
+
+	// a compiled world has the rects already, saving decoding the image
+	const CBitmap* cached( wf->LookupBitmap( full ) );
+	if( cached )
+		{
+			width = cached->width;
+			height = cached->height;
+			
+			for( size_t i(0); i+3 < cached->rects.size(); i += 4 )
+				{
+					rotrect_t rect;
+					rect.pose.x = cached->rects[i];
+					rect.pose.y = cached->rects[i+1];
+					rect.pose.a = 0.0;
+					rect.size.x = cached->rects[i+2];
+					rect.size.y = cached->rects[i+3];
+					rects.push_back( rect );
+				}
+		}
+	else
+		{
+			if( rotrects_from_image_file( full,
+																		rects,
+																		width, 
+																		height ) )
+				{
+					PRINT_ERR1( "failed to load rects from image file \"%s\"",
+											full.c_str() );
+					return;
+				}
+			
+			// remember the rects in case the world is compiled
+			CBitmap bitmap( full, width, height );
+			FOR_EACH( rect, rects )
+				{
+					bitmap.rects.push_back( rect->pose.x );
+					bitmap.rects.push_back( rect->pose.y );
+					bitmap.rects.push_back( rect->size.x );
+					bitmap.rects.push_back( rect->size.y );
+				}
+			wf->AddBitmap( bitmap );
+		}
   
   //printf( "found %d rects in \"%s\" at %p\n", 
   //	  rect_count, full, rects );
@@ -288,31 +321,10 @@ void BlockGroup::LoadBitmap( Model* mod, const std::string& bitmapfile, Worldfil
 	// TODO fix this
 	Color col( 1.0, 0.0, 1.0, 1.0 );
 	
-	FOR_EACH( rect, rects )
-		{
-			std::vector<point_t> pts(4);
-			
-			double x = rect->pose.x;
-			double y = rect->pose.y;
-			double w = rect->size.x;
-			double h = rect->size.y;
-			
-			pts[0].x = x;
-			pts[0].y = y;
-			pts[1].x = x + w;
-			pts[1].y = y;
-			pts[2].x = x + w;
-			pts[2].y = y + h;
-			pts[3].x = x;
-			pts[3].y = y + h;							 
-			
-			AppendBlock( new Block( mod,
-															pts,
-															0,1,
-															col,
-															true,
-															false) );		 
-		}			 
+	// a big image has many thousands of rectangles, so they make a
+	// single block rather than a block each
+	if( rects.size() )
+		AppendBlock( new Block( mod, rects, 0, 1, col, true ) );
   
   CalcSize();
 }
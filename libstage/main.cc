@@ -15,6 +15,7 @@ const char* USAGE =
   "Available [options] are:\n"
   "  --clock        : print simulation time peridically on standard output\n"
   "  -c             : equivalent to --clock\n"
+  "  --compile      : save each world in compiled form for fast loading, then quit\n"
   "  --gui          : run without a GUI\n"
   "  -g             : equivalent to --gui\n"
   "  --help         : print this message\n"
@@ -29,6 +30,7 @@ static struct option longopts[] = {
 	{ "clock",  optional_argument,   NULL,  'c' },
 	{ "help",  optional_argument,   NULL,  'h' },
 	{ "args",  required_argument,   NULL,  'a' },
+	{ "compile",  no_argument,   NULL,  'C' },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -42,6 +44,8 @@ int main( int argc, char* argv[] )
   int ch=0, optindex=0;
   bool usegui = true;
   bool showclock = false;
+  bool compile = false;
+  int compile_failures = 0;
   
   while ((ch = getopt_long(argc, argv, "cgh?", longopts, &optindex)) != -1)
 	 {
@@ -61,6 +65,10 @@ int main( int argc, char* argv[] )
 			 usegui = false;
 			 printf( "[GUI disabled]" );
 			 break;
+		  case 'C': 
+			 compile = true;
+			 printf( "[Compiling]" );
+			 break;
 		  case 'h':  
 		  case '?':  
 			 puts( USAGE );
@@ -84,6 +92,21 @@ int main( int argc, char* argv[] )
 		if( optindex > 0 )
 		  {      
 			 const char* worldfilename = argv[optindex];
+
+			 // save the world in compiled form instead of running it
+			 if( compile )
+				{
+				  World world( worldfilename );
+				  world.Load( worldfilename );
+				  if( ! world.Compile() )
+					 {
+						PRINT_ERR1( "failed to compile %s", worldfilename );
+						++compile_failures;
+					 }
+				  optindex++;
+				  continue;
+				}
+
 			 World* world = ( usegui ? 
 										new WorldGui( 400, 300, worldfilename ) : 
 									new World( worldfilename ) );
@@ -96,12 +119,14 @@ int main( int argc, char* argv[] )
 		optindex++;
 	 }
 
-  if( usegui )
+  if( compile )
+	 ; // nothing to run
+  else if( usegui )
 			Fl::run();	 
   else
 	 while( ! World::UpdateAll() );
 
   puts( "\n[Stage: done]" );
 
-	return EXIT_SUCCESS;
+	return( compile_failures ? EXIT_FAILURE : EXIT_SUCCESS );
 }
@@ -47,6 +47,7 @@
     gui_move 0 (1 if the model has no parents);
 
     boundary 0
+    fill_blocks 0
     mass 10.0
     map_resolution 0.1
     say ""
@@ -142,6 +143,11 @@
       _top_ of this model, making it easy to stack models together. If
       zero, the child coordinate system is not offset in z, making it
       easy to define objects in a single local coordinate system.
+
+    - fill_blocks <int>\n If non-zero, the interiors of the model's
+      blocks are filled in the world's occupancy grid, instead of just
+      their outlines. This gives solid occupancy for large blocks like
+      bitmap walls, at the cost of mapping more cells. Defaults to 0.
 */
 
 // todo
@@ -156,6 +162,7 @@
 #endif
 
 #include <map>
+#include <limits.h> // for INT_MAX
 
 //#define DEBUG 0
 #include "stage.hh"
@@ -343,6 +350,7 @@ Model::Model( World* world,
 				  const std::string& type ) :
   Ancestor(), 	 
   mapped(false),
+  mapped_static(false),
   drawOptions(),
   alwayson(false),
   blockgroup(),
@@ -354,6 +362,7 @@ Model::Model( World* world,
   disabled(false),
   cv_list(),
   flag_list(),
+  fill_blocks(false),
 	friction(DEFAULT_FRICTION),
   geom(),
   has_default_block( true ),
@@ -367,6 +376,7 @@ Model::Model( World* world,
   mass(0),
   parent(parent),
   pose(),
+  global_pose(),
   power_pack( NULL ),
   pps_charging(),
   rastervis(),
@@ -376,10 +386,12 @@ Model::Model( World* world,
   stall(false),	 
   subs(0),
   thread_safe( false ),
+  update_batch( UpdateBatch ),
   trail(trail_length),
   trail_index(0),
   type(type),	
   event_queue_num( 0 ),
+  fiducial_cell(),
   used(false),
   velocity(),
   velocity_enable( false ),
@@ -411,6 +423,8 @@ Model::Model( World* world,
       gui.move = true;
     }
 
+  UpdateGlobalPose();
+
   world->AddModel( this );
       
   // now we can add the basic square shape
@@ -492,6 +506,8 @@ void Model::ClearBlocks()
 {
   blockgroup.UnMap(0);
   blockgroup.UnMap(1);  
+  blockgroup.UnMap(STATIC_LAYER);  
+  mapped_static = false;
   blockgroup.Clear();
   //no need to Map() -  we have no blocks
   NeedRedraw();
@@ -666,12 +682,14 @@ void Model::LocalToPixels( const std::vector<point_t>& local,
 {
 	const Pose gpose = GetGlobalPose() + geom.pose;
 	
+	// the same as gpose + Pose( it->x, it->y, 0, 0 ), without finding
+	// the cos and sin for every point
+	const double cosa( cos(gpose.a) );
+	const double sina( sin(gpose.a) );
+	
 	FOR_EACH( it, local )
-		{
-			Pose ptpose = gpose + Pose( it->x, it->y, 0, 0 );
-			global.push_back( point_int_t( (int32_t)floor( ptpose.x * world->ppm) ,
-																		 (int32_t)floor( ptpose.y * world->ppm) ));
-		}
+		global.push_back( point_int_t( (int32_t)floor( (gpose.x + it->x * cosa - it->y * sina) * world->ppm ),
+																	 (int32_t)floor( (gpose.y + it->x * sina + it->y * cosa) * world->ppm ) ));
 }
 
 void Model::MapWithChildren( unsigned int layer )
@@ -698,6 +716,59 @@ void Model::UnMapWithChildren(unsigned int layer)
     (*it)->UnMapWithChildren(layer);
 }
 
+void Model::RemapWithChildren( unsigned int layer )
+{
+  // leaving the static layer means mapping from scratch
+  if( mapped_static )
+	 UnMap(layer);
+  
+  // Block::Map() re-renders a block that is already in this layer
+  // only if it moved
+  blockgroup.Map( layer );
+  mapped = true;
+
+  // recursive call for all the model's children
+  FOR_EACH( it, children )
+    (*it)->RemapWithChildren(layer);
+}
+
+bool Model::GetMoveBounds( unsigned int layer, point_int_t& min, point_int_t& max )
+{
+  const double interval( (double)world->sim_interval / 1e6 );
+  const Pose gpose( GetGlobalPose() );
+  
+  min = point_int_t( INT_MAX, INT_MAX );
+  max = point_int_t( INT_MIN, INT_MIN );
+  
+  return ExpandMoveBounds( layer, 
+									point_t( gpose.x * world->ppm, gpose.y * world->ppm ),
+									hypot( velocity.x, velocity.y ) * interval * world->ppm,
+									fabs( normalize( velocity.a * interval )),
+									min, max );
+}
+
+bool Model::ExpandMoveBounds( unsigned int layer, 
+										const point_t& origin, 
+										double reach, 
+										double turn,
+										point_int_t& min, 
+										point_int_t& max )
+{
+  // leaving the static layer touches cells we can't bound here
+  if( mapped_static )
+	 return false;
+  
+  FOR_EACH( it, blockgroup.blocks )
+	 if( ! (*it)->ExpandMoveBounds( layer, origin, reach, turn, min, max ) )
+		return false;
+  
+  FOR_EACH( it, children )
+	 if( ! (*it)->ExpandMoveBounds( layer, origin, reach, turn, min, max ) )
+		return false;
+  
+  return true;
+}
+
 void Model::UnMapFromRoot(unsigned int layer)
 {
 	Root()->UnMapWithChildren(layer);
@@ -820,7 +891,13 @@ void Model::Update( void )
 	// etc. We queue up the callback into a queue specific to
 
 	if( ! callbacks[Model::CB_UPDATE].empty() )
-		world->pending_update_callbacks[event_queue_num].push(this);					
+		world->pending_update_callbacks[event_queue_num].push_back(this);					
+}
+
+void Model::UpdateBatch( const ModelPtrVec& models )
+{
+  FOR_EACH( it, models )
+	 (*it)->Update();
 }
 
 void Model::CallUpdateCallbacks( void )
@@ -959,26 +1036,27 @@ void Model::Move( void )
   const Pose startpose( pose );
   
   pose = newpose; // do the move provisionally - we might undo it below
+  UpdateGlobalPose();
   
   //const unsigned int layer( world->updates%2 );
   
   const unsigned int layer( world->updates%2 );
   
-  UnMapWithChildren( layer ); // remove from all blocks
-  MapWithChildren( layer ); // render into new blocks
+  RemapWithChildren( layer ); // render into new cells
   
   if( TestCollision() ) // crunch!
 	 {
 		// put things back the way they were
 		// this is expensive, but it happens _very_ rarely for most people
 		pose = startpose;
-		UnMapWithChildren( layer );
-		MapWithChildren( layer );
+		UpdateGlobalPose();
+		RemapWithChildren( layer );
 		SetStall(true);
 	 }
   else
 	 {
-		world->dirty = true; // need redraw	
+		// World::Update() marks the world dirty, since we may be one of
+		// several models moving in parallel
 		SetStall(false);
 	 }
 }
@@ -1072,21 +1150,60 @@ void Model::Map( unsigned int layer )
 {
   if( ! mapped )
 	 {
-		// render all blocks in the group at my global pose and size
-		blockgroup.Map( layer );
+		// loading sets a model's geometry and pose several times over.
+		// A static model ends up in the static layer anyway, so it
+		// waits for the world to map it once it has loaded everything.
+		if( ! (world->loading && IsStatic()) )
+		  // render all blocks in the group at my global pose and size
+		  blockgroup.Map( layer );
 		mapped = true;
 	 }
 } 
 
 void Model::UnMap( unsigned int layer )
 {
+  if( mapped_static )
+	 {
+		// we're about to move, so leave the static layer for good. We
+		// will be mapped into the moving layers from now on.
+		blockgroup.UnMap( STATIC_LAYER );
+		mapped_static = false;
+		mapped = false;
+	 }
+  
   if( mapped )
 	 {
-		blockgroup.UnMap(layer);
+		if( ! (world->loading && IsStatic()) )
+		  blockgroup.UnMap(layer);
 		mapped = false;
 	 }
 }
 
+void Model::MapStatic()
+{
+  if( mapped_static )
+	 return;
+
+  blockgroup.UnMap(0);
+  blockgroup.UnMap(1);
+  blockgroup.Map( STATIC_LAYER );
+  mapped = true;
+  mapped_static = true;
+
+  // new static blocks may be nearer than the distance field says
+  if( world->distance_field )
+	 world->FreeDistanceField();
+}
+
+bool Model::IsStatic() const
+{
+  for( const Model* m(this); m; m = m->parent )
+	 if( m->velocity_enable )
+		return false;
+
+  return true;
+}
+
 void Model::BecomeParentOf( Model* child )
 {
   if( child->parent )
@@ -1098,6 +1215,8 @@ void Model::BecomeParentOf( Model* child )
   
   this->AddChild( child );
   
+  child->UpdateGlobalPose();
+  
   world->dirty = true; 
 }
 
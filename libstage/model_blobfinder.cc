@@ -86,6 +86,7 @@ blobfinder
 						vis( world ),
 						blobs(),
 						colors(),
+						samples(),
 						fov( DEFAULT_BLOBFINDERFOV ),
 						pan( DEFAULT_BLOBFINDERPAN ),
 						range( DEFAULT_BLOBFINDERRANGE ),
@@ -180,9 +181,10 @@ void ModelBlobfinder::Update( void )
 {     
 	// generate a scan for post-processing into a blob image
 	
-	RaytraceResult* samples = new RaytraceResult[scan_width];
+	samples.resize( scan_width );
 
-	Raytrace( pan, range, fov, blob_match, NULL, samples, scan_width, false );
+	if( scan_width )
+	  Raytrace( pan, range, fov, blob_match, NULL, &samples[0], scan_width, false );
 
 	// now the colors and ranges are filled in - time to do blob detection
 	double yRadsPerPixel = fov / scan_height;
@@ -262,8 +264,6 @@ void ModelBlobfinder::Update( void )
 		blobs.push_back( blob );
 	}
 
-	delete [] samples;
-
 	Model::Update();
 }
 
@@ -69,6 +69,7 @@ fiducial
 										  const std::string& type ) : 
   Model( world, parent, type ),
   fiducials(),
+  nearby(),
   max_range_anon( 8.0 ),
   max_range_id( 5.0 ),
   min_range( 0.0 ),
@@ -240,49 +241,13 @@ void ModelFiducial::Update( void )
 	fiducials.clear();
 
 #if( 1 )	
-	// BEGIN EXPERIMENT
-	
-	// find two sets of fiducial-bearing models, within sensor range on
-	// the two different axes
-	
-	double rng = max_range_anon;
-	Pose gp = GetGlobalPose();	
-	Model edge;	// dummy model used to find bounds in the sets
-	
-	edge.pose = Pose( gp.x-rng, gp.y, 0, 0 ); // LEFT
-	std::set<Model*,World::ltx>::iterator xmin = 
-		world->models_with_fiducials_byx.lower_bound( &edge ); // O(log(n))
-	
-	edge.pose = Pose( gp.x+rng, gp.y, 0, 0 ); // RIGHT
-	const std::set<Model*,World::ltx>::iterator xmax = 
-		world->models_with_fiducials_byx.upper_bound( &edge );
-	
-	edge.pose = Pose( gp.x, gp.y-rng, 0, 0 ); // BOTTOM
-	std::set<Model*,World::lty>::iterator ymin = 
-		world->models_with_fiducials_byy.lower_bound( &edge );
-	
-	edge.pose = Pose( gp.x, gp.y+rng, 0, 0 ); // TOP
-	const std::set<Model*,World::lty>::iterator ymax = 
-		world->models_with_fiducials_byy.upper_bound( &edge );
-		
-	// put these models into sets keyed on model pointer, rather than position
-	std::set<Model*> horiz, vert;
-	
-	for( ; xmin != xmax;  xmin++)
-		horiz.insert( *xmin);
-	
-	for( ; ymin != ymax; ymin++ )
-		vert.insert( *ymin );
-	
-	// the intersection of the sets is all the fiducials close by
-	std::vector<Model*> nearby;
-	std::set_intersection( horiz.begin(), horiz.end(),
-												 vert.begin(), vert.end(),
-												 std::inserter( nearby, nearby.end() ) ); 
+	// find the fiducial-bearing models close enough to see, from the
+	// world's grid
+	nearby.clear();
+	world->FiducialsNear( GetGlobalPose(), max_range_anon, nearby );
 	
 	//	printf( "cand sz %lu\n", nearby.size() );
 			
-	// create sets sorted by x and y position
  	FOR_EACH( it, nearby ) 
  			AddModelIfVisible( *it );	
 #else
@@ -309,6 +274,9 @@ void ModelFiducial::Load( void )
 	max_range_id          = wf->ReadLength( wf_entity, "range_max_id", max_range_id );
 	fov                   = wf->ReadAngle ( wf_entity, "fov",          fov );
   ignore_zloc            = wf->ReadInt  ( wf_entity, "ignore_zloc",  ignore_zloc);
+
+	// so the world can find fiducials in range quickly
+	world->FiducialRange( max_range_anon );
 }  
 
 
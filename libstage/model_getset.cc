@@ -8,6 +8,7 @@ void Model::SetGeom( const Geom& val )
   UnMapWithChildren(1);
   
   geom = val;
+  UpdateGlobalPose(); // children may be stacked on top
   
   blockgroup.CalcSize();
   
@@ -130,6 +131,8 @@ int Model::SetParent( Model* newparent)
   else
     world->AddModel( this );
 
+  UpdateGlobalPose();
+
   CallCallbacks( CB_PARENT );
 
   SetGlobalPose( oldPose ); // Needs to recalculate position due to change in parent
@@ -170,19 +173,22 @@ void Model::SetGlobalVelocity( const Velocity& gv )
 }
 
 // get the model's position in the global frame
-Pose Model::GetGlobalPose() const
+void Model::UpdateGlobalPose()
 { 
   // if I'm a top level model, my global pose is my local pose
   if( parent == NULL )
-    return pose;
-  
-  // otherwise    
-  Pose global_pose = parent->GetGlobalPose() + pose;		
-  
-  if ( parent->stack_children ) // should we be on top of our parent?
-    global_pose.z += parent->geom.size.z;
+    global_pose = pose;
+  else
+	 {
+		global_pose = parent->global_pose + pose;		
+		
+		if ( parent->stack_children ) // should we be on top of our parent?
+		  global_pose.z += parent->geom.size.z;
+	 }
   
-  return global_pose;
+  // and my descendents' poses depend on mine
+  FOR_EACH( it, children )
+	 (*it)->UpdateGlobalPose();
 }
 
 void Model::VelocityEnable()
@@ -212,6 +218,7 @@ void Model::SetPose( const Pose& newpose )
     {
       pose = newpose;
       pose.a = normalize(pose.a);
+		UpdateGlobalPose();
 
 //       if( isnan( pose.a ) )
 // 		  printf( "SetPose bad angle %s [%.2f %.2f %.2f %.2f]\n",
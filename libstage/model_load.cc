@@ -194,6 +194,7 @@ void Model::Load()
   
   this->stack_children =
     wf->ReadInt( wf_entity, "stack_children", this->stack_children );
+  UpdateGlobalPose(); // children may be stacked on top
   
   kg_t m = wf->ReadFloat(wf_entity, "mass", this->mass );
   if( m != this->mass ) 
@@ -209,6 +210,8 @@ void Model::Load()
     SetMapResolution( res );
   
   velocity_enable = wf->ReadInt( wf_entity, "enable_velocity", velocity_enable );
+
+  fill_blocks = wf->ReadInt( wf_entity, "fill_blocks", fill_blocks );
 	
   if( wf->PropertyExists( wf_entity, "friction" ))
   {
@@ -280,6 +283,7 @@ void Model::Save( void )
   // just in case
   pose.a = normalize( pose.a );
   geom.pose.a = normalize( geom.pose.a );
+  UpdateGlobalPose();
   
   if( wf->PropertyExists( wf_entity, "pose" ) )
     {
@@ -182,33 +182,31 @@ void ModelRanger::Sensor::Update( ModelRanger* mod )
 {
 	ranges.resize( sample_count );
 	intensities.resize( sample_count );
+	samples.resize( sample_count );
+
+	// the fan only changes if someone changes fov or sample_count
+	if( directions.size() != sample_count || directions_fov != fov )
+		{
+			World::FanDirections( fov, sample_count, directions );
+			directions_fov = fov;
+		}
 
 	//printf( "update sensor, has ranges size %u\n", (unsigned int)ranges.size() );
 	
-	double bearing( sample_count > 1 ? -fov/2.0 : 0.0 );
-	// make the first and last rays exactly at the extremes of the FOV
-	double sample_incr( fov / std::max(sample_count-1, (unsigned int)1) );
-	
-  // find the global origin of our first emmitted ray
+  // find the global origin of the center ray
   Pose rayorg( pose );//mod->GetPose() );
-	rayorg.a += bearing;
   rayorg.z += size.z/2.0;
   rayorg = mod->LocalToGlobal(rayorg);
   
-  // set up a ray to trace
-  Ray ray( mod, rayorg, range.max, ranger_match, NULL, true );
-  
-	World* world = mod->GetWorld();
+  // trace the whole scan as a single fan of rays
+  mod->GetWorld()->RaytraceFan( Ray( mod, rayorg, range.max, ranger_match, NULL, true ),
+																fov, &samples[0], sample_count, &directions[0] );
 
-  // trace the ray, incrementing its heading for each sample
   for( size_t t(0); t<sample_count; t++ )
     {
-			const RaytraceResult& r ( world->Raytrace( ray ) );
+			const RaytraceResult& r ( samples[t] );
 			ranges[t] = r.range;
 			intensities[t] = r.mod ? r.mod->vis.ranger_return : 0.0;
-			
-			// point the ray to the next angle
-			ray.origin.a += sample_incr;			
 
 			//printf( "ranger %s sensor %p pose %s sample %d range %.2f ref %.2f\n",
 			//			mod->Token(), 
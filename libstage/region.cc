@@ -13,14 +13,24 @@ std::vector<Stg::Cell*> Region::dead_pool;
 Region::Region() : 
   cells(), 
   count(0),
+  occupancy(NULL),
+  clearance(NULL),
   superregion(NULL)
 {
+  for( int l(0); l<3; ++l )
+	 occupied[l] = 0;
 }
 
 Region::~Region()
 {
 	if( cells )
 		delete[] cells;
+
+	if( occupancy )
+		delete[] occupancy;
+
+	if( clearance )
+		delete[] clearance;
 }
 
 void Region::AddBlock()
@@ -28,14 +38,12 @@ void Region::AddBlock()
 
 	++count; 
 	assert(count>0);
-	superregion->AddBlock();
 }
 
 void Region::RemoveBlock()
 {
 	--count; 
 	assert(count>=0); 
-	superregion->RemoveBlock();
 	
 	// if there's nothing in this region, we can garbage collect the
 	// cells to keep memory usage under control
@@ -55,8 +63,7 @@ void Region::RemoveBlock()
 }
 
 SuperRegion::SuperRegion( World* world, point_int_t origin ) 
-  : count(0),
-		rwlock(),
+  : rwlock(),
 		origin(origin), 
 		regions(),
 		world(world)
@@ -72,18 +79,6 @@ SuperRegion::~SuperRegion()
 }
 
 
-void SuperRegion::AddBlock()
-{ 
-	++count; 
-	assert(count>0);
-}
-
-void SuperRegion::RemoveBlock()
-{
-	--count; 
-	assert(count>=0); 
-}		
-
 
 void SuperRegion::DrawOccupancy( unsigned int layer ) const
 {
@@ -116,10 +111,10 @@ void SuperRegion::DrawOccupancy( unsigned int layer ) const
 			 glTranslatef( 0.05, 0.05, 0);
 			 glColor3f( 0,0,1 );    
 			 break;
-// 		  case 2: // fixed 
-// 			 glTranslatef( 0.1, 0.1, 0);
-// 			 glColor3f( 1,0,0 );    
-// 			 break;
+		  case STATIC_LAYER: // fixed 
+			 glTranslatef( 0.1, 0.1, 0);
+			 glColor3f( 1,0,0 );    
+			 break;
 		  default:
 			 PRINT_ERR1( "error: wrong layer %d", layer );			 
 		  }
@@ -188,6 +183,11 @@ void SuperRegion::DrawOccupancy( unsigned int layer ) const
 		glColor3f( 0,0,1 );   
 	 }
   
+  // show how many blocks are rendered into the whole superregion
+  unsigned long count(0);
+  for( int32_t r=0; r<SUPERREGIONSIZE; ++r )
+	 count += regions[r].count;
+  
   char buf[32];
   snprintf( buf, 15, "%lu", count );
   Gl::draw_string( 1<<SBITS, 1<<SBITS, 0, buf );
@@ -291,15 +291,27 @@ void SuperRegion::DrawVoxels(unsigned int layer) const
 
 void Stg::Cell::AddBlock( Block* b, unsigned int layer )
 {			
-  assert( layer < 2 );
+  assert( layer < 3 );
   blocks[layer].push_back( b );   
-  b->rendered_cells[layer].push_back(this);
   region->AddBlock();
+
+  const size_t len( blocks[layer].size() );
+  if( len <= 2 ) // cell was empty, or held one block, until now
+	 {
+		// set the cell's bit in the occupancy bitmap, or in the
+		// crowding bitmap that follows it
+		const int32_t i( this - region->cells );
+		const unsigned int map( len == 1 ? layer : 3 + layer );
+		region->occupancy[ map * REGIONWIDTH + (i >> RBITS) ] |= 1U << (i & CELLMASK);
+
+		if( len == 1 )
+		  ++region->occupied[layer];
+	 }
 }
 
 void Stg::Cell::RemoveBlock( Block* b, unsigned int layer )
 {
-  assert( layer<2 );
+  assert( layer<3 );
   
   std::vector<Block*>& blks = blocks[layer];
 
@@ -338,6 +350,20 @@ void Stg::Cell::RemoveBlock( Block* b, unsigned int layer )
 		  }
 		blks.resize( w-start );
 #endif
+
+		if( blks.size() < 2 ) // cell is now empty, or uncrowded
+		  {
+			 const int32_t i( this - region->cells );
+			 const uint32_t bit( 1U << (i & CELLMASK) );
+			 
+			 region->occupancy[ (3 + layer) * REGIONWIDTH + (i >> RBITS) ] &= ~bit;
+
+			 if( blks.empty() )
+				{
+				  region->occupancy[ layer * REGIONWIDTH + (i >> RBITS) ] &= ~bit;
+				  --region->occupied[layer];
+				}
+		  }
 	 }
 
   region->RemoveBlock();
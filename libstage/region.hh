@@ -20,6 +20,11 @@ namespace Stg
 
   const int32_t SUPERREGIONWIDTH( 1<<SBITS );
   const int32_t SUPERREGIONSIZE( SUPERREGIONWIDTH*SUPERREGIONWIDTH );
+
+  // the distance field has an entry for each (2^CLEARBITS)^2 cells,
+  // so a region's entries fit in a cache line
+  const int32_t CLEARBITS( 2 );
+  const int32_t CLEARWIDTH( REGIONWIDTH>>CLEARBITS );
 		
   const int32_t CELLMASK( ~((~0x00)<< RBITS ));
   const int32_t REGIONMASK( ~((~0x00)<< SRBITS ));
@@ -37,7 +42,7 @@ namespace Stg
 		friend class World;
 	 
   private:
-	 std::vector<Block*> blocks[2];		
+	 std::vector<Block*> blocks[3]; // layers 0 and 1, then STATIC_LAYER
 	 
   public:
 	 Cell() 
@@ -57,10 +62,34 @@ namespace Stg
   {
 	 friend class SuperRegion;
 	 friend class World; // for raytracing
+	 friend class Cell; // to maintain the occupancy bitmaps
+	 friend class Block; // to check them for collisions
 	 
   private:
 	 Cell* cells;
 	 unsigned long count; // number of blocks rendered into this region
+
+	 /** Occupancy bitmaps, allocated along with the cells. For each
+		  layer there are REGIONWIDTH words, one per row of cells, with
+		  bit x of word y set iff cell (x,y) contains blocks. This lets
+		  the raytracer skip empty cells without touching them. Requires
+		  REGIONWIDTH <= 32. They are followed by crowding bitmaps in the
+		  same layout, with a bit set iff the cell contains more than
+		  one block. */
+	 uint32_t* occupancy;
+	 
+	 /** The number of cells containing blocks in each layer. */
+	 unsigned int occupied[3];
+	 
+	 /** Distance field of the static layer, or NULL if it has not been
+		  built for this region. For each square of 2^CLEARBITS by
+		  2^CLEARBITS cells, in rows of CLEARWIDTH, the least Manhattan
+		  distance in cells from any of them to a cell containing a
+		  static block, up to 255, so a ray can step over the cells
+		  nearer than that. Only blocks leave the static layer once it
+		  is built, so the distances can only be too small, which is
+		  safe. */
+	 uint8_t* clearance;
 	 
 	 // vector of garbage collected cell arrays to reallocate before
 	 // using new in GetCell()
@@ -88,8 +117,22 @@ namespace Stg
 			 for( int32_t c=0; c<REGIONSIZE;++c)
 				cells[c].region = this;
 		  } 
+
+		if( occupancy == NULL )
+		  occupancy = new uint32_t[ 2 * 3 * REGIONWIDTH ](); // zeroed
+		
 		return( &cells[ x + y * REGIONWIDTH ] );
 	 }
+
+	 /** Returns the occupancy bitmap for the layer: bit x of word y
+		  is set iff cell (x,y) contains blocks. */
+	 inline const uint32_t* GetOccupancy( unsigned int layer ) const
+	 { return( occupancy + layer * REGIONWIDTH ); }
+
+	 /** Returns the crowding bitmap for the layer: bit x of word y is
+		  set iff cell (x,y) contains more than one block. */
+	 inline const uint32_t* GetCrowding( unsigned int layer ) const
+	 { return( occupancy + (3 + layer) * REGIONWIDTH ); }
 	 	 
 	 inline void AddBlock();
 	 inline void RemoveBlock(); 
@@ -101,7 +144,6 @@ namespace Stg
   class SuperRegion
   {
   private:
-	 unsigned long count; // number of blocks rendered into this superregion
 	 pthread_rwlock_t rwlock;
 	 point_int_t origin;
 	 Region regions[SUPERREGIONSIZE];
@@ -123,9 +165,6 @@ namespace Stg
 	 inline void WriteLock(){ pthread_rwlock_wrlock( &rwlock); }
 	 inline void Unlock(){ pthread_rwlock_unlock( &rwlock); }
 	 
-	 inline void AddBlock();
-	 inline void RemoveBlock();		
-	 
 	 const point_int_t& GetOrigin() const { return origin; }
   }; // class SuperRegion;
   
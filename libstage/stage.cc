@@ -5,6 +5,9 @@
 #include "stage.hh"
 #include "config.h" // results of cmake's system configuration tests
 #include "file_manager.hh"
+
+#include <new> // for std::bad_alloc
+#include <unistd.h> // for getpid()
 using namespace Stg;
 
 static bool init_called = false;
@@ -43,6 +46,52 @@ bool Stg::InitDone()
   return init_called;
 }
 
+#ifdef COUNT_ALLOCATIONS
+
+// count every allocation made with operator new in the whole program,
+// from any thread
+
+static uint64_t allocation_count = 0;
+
+void* operator new( size_t size )
+{
+  __atomic_add_fetch( &allocation_count, 1, __ATOMIC_RELAXED );
+  
+  void* p( malloc( size ? size : 1 ) );
+  if( p == NULL )
+	 throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[]( size_t size )
+{ 
+  return operator new( size ); 
+}
+
+void operator delete( void* p ) throw()
+{ 
+  free( p ); 
+}
+
+void operator delete[]( void* p ) throw()
+{ 
+  free( p ); 
+}
+
+uint64_t Stg::AllocationCount()
+{
+  return __atomic_load_n( &allocation_count, __ATOMIC_RELAXED );
+}
+
+#else
+
+uint64_t Stg::AllocationCount()
+{
+  return 0;
+}
+
+#endif
+
 const Color Color::blue( 0,0,1 );
 const Color Color::red( 1,0,0 );
 const Color Color::green( 0,1,0 );
@@ -60,24 +109,6 @@ static inline uint8_t* pb_get_pixel( Fl_Shared_Image* img,
   return( pixels + index );
 }
 
-// set all the pixels in a rectangle 
-static inline void pb_set_rect( Fl_Shared_Image* pb, 
-																const unsigned int x, const unsigned int y, 
-																const unsigned int width, const unsigned int height, 
-																const uint8_t val )
-{
-  const unsigned int bytes_per_sample = 1;
-  const unsigned int num_samples = pb->d();
-	
-  for( unsigned int a = y; a < y+height; a++ )
-		for( unsigned int b = x; b < x+width; b++ )
-			{	
-				// zeroing
-				uint8_t* pix = pb_get_pixel( pb, b, a );
-				memset( pix, val, num_samples * bytes_per_sample );
-			}
-}  
-
 // returns true if the value in the first channel is above threshold
 static inline bool pb_pixel_is_set( Fl_Shared_Image* img, 
 																		const unsigned int x, 
@@ -87,14 +118,171 @@ static inline bool pb_pixel_is_set( Fl_Shared_Image* img,
   return( pb_get_pixel( img,x,y )[0] > threshold );
 }
 
+bool Stg::hash_file( const std::string& filename, uint64_t& hash )
+{
+  FILE* file = fopen( filename.c_str(), "rb" );
+  if( file == NULL )
+	 return false;
+
+  // 64 bit FNV-1a
+  hash = 14695981039346656037ULL;
+
+  unsigned char buf[4096];
+  size_t len;
+  while( (len = fread( buf, 1, sizeof(buf), file )) > 0 )
+	 for( size_t i(0); i < len; ++i )
+		{
+		  hash ^= buf[i];
+		  hash *= 1099511628211ULL;
+		}
+
+  fclose( file );
+  return true;
+}
+
+// the first bytes of a rectangle cache file
+static const char RECTS_MAGIC[8] = { 'S', 't', 'a', 'g', 'e', 'R', 'C', 0 };
+
+// the cache files are written in the machine's byte order
+static const uint32_t RECTS_BYTE_ORDER = 0x01020304;
+
+// Find the name of the file that caches the rectangles of an image
+// with the given hash. Caching is off unless STAGECACHE names a
+// directory for it, since the images may be anywhere, including in
+// the source tree or an installed copy.
+static bool rects_cache_name( uint64_t hash, std::string& name )
+{
+  const char* dir( getenv( "STAGECACHE" ) );
+  if( dir == NULL || dir[0] == 0 )
+	 return false;
+  
+  char file[32];
+  snprintf( file, sizeof(file), "/%016llx.rects", (unsigned long long)hash );
+  name = std::string( dir ) + file;
+  return true;
+}
+
+// A cache file holds the magic, version, byte order, image hash and
+// threshold, then the image's width and height, the number of
+// rectangles, and x,y,width,height for each rectangle.
+static bool read_rects_cache( const std::string& filename,
+										uint64_t hash,
+										uint32_t threshold,
+										std::vector<rotrect_t>& rects,
+										unsigned int& width, 
+										unsigned int& height )
+{
+  FILE* file = fopen( filename.c_str(), "rb" );
+  if( file == NULL )
+	 return false;
+  
+  char magic[sizeof(RECTS_MAGIC)];
+  uint32_t header[4]; // version, byte order, threshold, rect count
+  uint64_t file_hash;
+  uint32_t size[2];
+  
+  bool ok( fread( magic, sizeof(magic), 1, file ) == 1 &&
+			  memcmp( magic, RECTS_MAGIC, sizeof(magic) ) == 0 &&
+			  fread( header, sizeof(header), 1, file ) == 1 &&
+			  fread( &file_hash, sizeof(file_hash), 1, file ) == 1 &&
+			  fread( size, sizeof(size), 1, file ) == 1 &&
+			  header[0] == RECTS_VERSION &&
+			  header[1] == RECTS_BYTE_ORDER &&
+			  header[2] == threshold &&
+			  file_hash == hash );
+  
+  std::vector<uint32_t> data;
+  if( ok )
+	 {
+		data.resize( 4 * header[3] );
+		ok = data.empty() || fread( &data[0], sizeof(uint32_t), data.size(), file ) == data.size();
+	 }
+  
+  fclose( file );
+  
+  if( ! ok )
+	 return false;
+  
+  width = size[0];
+  height = size[1];
+  
+  for( size_t i(0); i < data.size(); i += 4 )
+	 {
+		rotrect_t rect;
+		rect.pose.x = data[i];
+		rect.pose.y = data[i+1];
+		rect.pose.a = 0.0;
+		rect.size.x = data[i+2];
+		rect.size.y = data[i+3];
+		rects.push_back( rect );
+	 }
+  
+  return true;
+}
+
+static void write_rects_cache( const std::string& filename,
+										 uint64_t hash,
+										 uint32_t threshold,
+										 const std::vector<rotrect_t>& rects,
+										 unsigned int width, 
+										 unsigned int height )
+{
+  const uint32_t header[4] = { RECTS_VERSION, RECTS_BYTE_ORDER, threshold, (uint32_t)rects.size() };
+  const uint32_t size[2] = { width, height };
+  
+  std::vector<uint32_t> data;
+  FOR_EACH( rect, rects )
+	 {
+		data.push_back( rect->pose.x );
+		data.push_back( rect->pose.y );
+		data.push_back( rect->size.x );
+		data.push_back( rect->size.y );
+	 }
+  
+  // write a file of our own and then move it into place, so that
+  // another Stage reading the cache never sees half a file
+  char suffix[32];
+  snprintf( suffix, sizeof(suffix), ".%d.tmp", (int)getpid() );
+  const std::string temp( filename + suffix );
+  
+  // the cache may well be somewhere we can't write, in which case we
+  // just find the rectangles again next time
+  FILE* file = fopen( temp.c_str(), "wb" );
+  if( file == NULL )
+	 {
+		PRINT_DEBUG1( "unable to write rectangle cache %s", temp.c_str() );
+		return;
+	 }
+  
+  bool ok( fwrite( RECTS_MAGIC, sizeof(RECTS_MAGIC), 1, file ) == 1 &&
+			  fwrite( header, sizeof(header), 1, file ) == 1 &&
+			  fwrite( &hash, sizeof(hash), 1, file ) == 1 &&
+			  fwrite( size, sizeof(size), 1, file ) == 1 &&
+			  (data.empty() || fwrite( &data[0], sizeof(uint32_t), data.size(), file ) == data.size()) );
+  
+  if( fclose( file ) != 0 || ! ok || rename( temp.c_str(), filename.c_str() ) != 0 )
+	 remove( temp.c_str() );
+}
+
 int Stg::rotrects_from_image_file( const std::string& filename, 
 																	 std::vector<rotrect_t>& rects,
 																	 unsigned int& width, 
 																	 unsigned int& height )
 {
   // TODO: make this a parameter
-  const int threshold = 127;
+  const int threshold = RECTS_THRESHOLD;
 	
+  // decoding the image and covering it with rectangles is slow for
+  // big maps, so reuse the rectangles from last time if the image
+  // hasn't changed
+  uint64_t hash(0);
+  std::string cachefile;
+  const bool cached( hash_file( filename, hash ) && 
+							rects_cache_name( hash, cachefile ) );
+  if( cached && read_rects_cache( cachefile, hash, threshold, 
+											 rects, width, height ) )
+	 return 0; // ok
+
   Fl_Shared_Image *img = Fl_Shared_Image::get(filename.c_str());
   if( img == NULL ) {
 		std::cerr << "failed to open file: " << filename << std::endl;
@@ -107,80 +295,77 @@ int Stg::rotrects_from_image_file( const std::string& filename,
   width = img->w();
   height = img->h();
 
+  // the dark pixels are the ones to cover with rectangles
+  std::vector<uint8_t> dark( width * height );
+  for(unsigned int y = 0; y < height; y++)
+	 for(unsigned int x = 0; x < width; x++)
+		dark[ y*width + x ] = ! pb_pixel_is_set( img,x,y, threshold);
+  
+  img->release(); // frees all resources for this image
+  
+  // Rectangles may overlap, so each one grows over every dark pixel
+  // it can, not just the uncovered ones. Where walls cross, the wall
+  // found first then no longer cuts the other one in two.
+  std::vector<uint8_t> covered( width * height, 0 );
+  
   for(unsigned int y = 0; y < height; y++)
-	{
-	  for(unsigned int x = 0; x < width; x++)
+	 for(unsigned int x = 0; x < width; x++)
 		{
-		  // skip blank (white) pixels
-		  if(  pb_pixel_is_set( img,x,y, threshold) )
-			continue;
-
-		  // a rectangle starts from this point
-		  unsigned int startx = x;
-		  unsigned int starty = y;
-		  unsigned int rheight = height; // assume full height for starters
-
-		  // grow the width - scan along the line until we hit an empty (white) pixel
-		  for( ; x < width &&  ! pb_pixel_is_set(img,x,y,threshold); x++ )
-			{
-			  // handle horizontal cropping
-			  //double ppx = x * sx;
-			  //if (ppx < this->crop_ax || ppx > this->crop_bx)
-			  //continue;
-
-			  // look down to see how large a rectangle below we can make
-			  unsigned int yy  = y;
-			  while( ! pb_pixel_is_set(img,x,yy,threshold) && (yy < height-1) )
-				{ 
-				  // handle vertical cropping
-				  //double ppy = (this->image->height - yy) * sy;
-				  //if (ppy < this->crop_ay || ppy > this->crop_by)
-				  //continue;
-
+		  const size_t start( y*width + x );
+		  
+		  // each rectangle starts from a dark pixel that no rectangle
+		  // covers yet
+		  if( ! dark[start] || covered[start] )
+			 continue;
+		  
+		  // grow across and then down
+		  unsigned int w1(1), h1(1);
+		  while( x+w1 < width && dark[start+w1] )
+			 w1++;
+		  for( ; y+h1 < height; h1++ )
+			 {
+				const uint8_t* row( &dark[start + h1*width] );
+				if( std::find( row, row + w1, 0 ) != row + w1 )
+				  break;
+			 }
+
+		  // grow down and then across
+		  unsigned int w2(1), h2(1);
+		  while( y+h2 < height && dark[start + h2*width] )
+			 h2++;
+		  for( ; x+w2 < width; w2++ )
+			 {
+				unsigned int yy(0);
+				while( yy < h2 && dark[start + yy*width + w2] )
 				  yy++;
-				} 	      
-
-			  // now yy is the depth of a line of non-zero pixels
-			  // downward we store the smallest depth - that'll be the
-			  // height of the rectangle
-			  if( yy-y < rheight ) rheight = yy-y; // shrink the height to fit
-			} 
-
-		  // whiten the pixels we have used in this rect
-		  pb_set_rect( img, startx, starty, x-startx, rheight, 0xFF );
-
+				if( yy < h2 )
+				  break;
+			 }
+		  
+		  // keep the bigger of the two
+		  const unsigned int rwidth( w1*h1 >= w2*h2 ? w1 : w2 );
+		  const unsigned int rheight( w1*h1 >= w2*h2 ? h1 : h2 );
+		  
+		  for( unsigned int a(0); a < rheight; a++ )
+			 memset( &covered[start + a*width], 1, rwidth );
+		  
 		  //  y-invert all the rectangles because we're using conventional
 		  // rather than graphics coordinates. this is much faster than
 		  // inverting the original image.
-
-		  rotrect_t latest;// = &(*rects)[(*rect_count)-1];
-		  latest.pose.x = startx;
-		  latest.pose.y = height-1 - (starty + rheight);
+		  rotrect_t latest;
+		  latest.pose.x = x;
+		  latest.pose.y = height - (y + rheight);
 		  latest.pose.a = 0.0;
-		  latest.size.x = x - startx;
+		  latest.size.x = rwidth;
 		  latest.size.y = rheight;
-
-		  assert( latest.pose.x >= 0 );
-		  assert( latest.pose.y >= 0 );
-		  assert( latest.pose.x <= width );
-		  assert( latest.pose.y <= height);
-
-			rects.push_back( latest );
-		  //assert( latest->size.x > 0 );
-		  //assert( latest->size.y > 0 );
-
-		  // 			if( latest->size.x < 1  || latest->size.y < 1 )
-		  // 			  printf( "p [%.2f %.2f] s [%.2f %.2f]\n", 
-		  // 						 latest->pose.x, latest->pose.y, latest->size.x, latest->size.y );
-
-		  //printf( "rect %d (%.2f %.2f %.2f %.2f %.2f\n", 
-		  //  *rect_count, 
-		  //  latest->x, latest->y, latest->a, latest->w, latest->h );
-
+		  
+		  rects.push_back( latest );
 		}
-	}
-
-  if( img ) img->release(); // frees all resources for this image
+  
+  if( cached )
+	 write_rects_cache( cachefile, hash, threshold, 
+							  rects, width, height );
+  
   return 0; // ok
 }
 
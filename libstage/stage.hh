@@ -92,12 +92,29 @@ namespace Stg
   /** Vector of pointers to Models. */
   typedef std::vector<Model*> ModelPtrVec;
 
+  /** A function that updates a batch of models of the same type. */
+  typedef void (*update_batch_t)( const ModelPtrVec& models );
+
   /** Set of pointers to Blocks. */
   typedef std::set<Block*> BlockPtrSet;
 
   /** Vector of pointers to Cells.*/
   typedef std::vector<Cell*> CellPtrVec;
 
+  /** A run of cells that are adjacent in one row of a region, and so
+		are also adjacent in memory. */
+  class CellSpan
+  {
+  public:
+	 Cell* start; ///< the leftmost cell of the run
+	 uint32_t count; ///< the number of cells in the run
+	 
+	 CellSpan( Cell* start, uint32_t count ) : start(start), count(count) {}
+  };
+  
+  /** Vector of CellSpans. */
+  typedef std::vector<CellSpan> CellSpanVec;
+
   /** Initialize the Stage library. Stage will parse the argument
 			array looking for parameters in the conventnioal way. */
   void Init( int* argc, char** argv[] );
@@ -105,6 +122,11 @@ namespace Stg
   /** returns true iff Stg::Init() has been called. */
   bool InitDone();
   
+  /** returns the number of heap allocations made with operator new
+		so far, if Stage was built with COUNT_ALLOCATIONS, or zero
+		otherwise. For finding allocations in the simulation loop. */
+  uint64_t AllocationCount();
+  
   /** returns a human readable string indicating the libstage version
 		number. */
   const char* Version();
@@ -156,6 +178,12 @@ namespace Stg
   /** Convenient constant */
   const double billion = 1e9;
 
+  /** Index of the occupancy grid layer holding models that never
+		move. Layers 0 and 1 are double-buffered for models that move,
+		and are alternated each update, while this layer is shared by
+		both and written only when models join or leave it. */
+  const unsigned int STATIC_LAYER = 2;
+
   /** convert an angle in radians to degrees. */
   inline double rtod( double r ){ return( r*180.0/M_PI ); }
   
@@ -588,16 +616,32 @@ namespace Stg
     Size size;
   } rotrect_t; // rotated rectangle
 
-  /** load the image file [filename] and convert it to an array of
-      rectangles, filling in the number of rects, width and
-      height. Memory is allocated for the rectangle array [rects], so
-      the caller must free [rects].
+  /** Pixels of an image darker than this are covered with
+      rectangles by rotrects_from_image_file() */
+  const uint32_t RECTS_THRESHOLD = 127;
+
+  /** Changes whenever rotrects_from_image_file() would find other
+      rectangles in the same image, so that saved rectangles can be
+      checked */
+  const uint32_t RECTS_VERSION = 1;
+
+  /** load the image file [filename] and cover its dark pixels with
+      rectangles, appending them to [rects] and filling in the image's
+      width and height. If the STAGECACHE environment variable names
+      a directory, the rectangles are cached there, in a file named
+      by a hash of the image, and reused while the image is
+      unchanged.
   */
   int rotrects_from_image_file( const std::string& filename, 
 																std::vector<rotrect_t>& rects,
 																unsigned int& widthp, 
 																unsigned int& heightp );
 
+  /** Find the 64 bit FNV-1a hash of the contents of [filename], to
+      tell whether the file has changed. Returns false if the file
+      can't be read. */
+  bool hash_file( const std::string& filename, uint64_t& hash );
+
   
   /** matching function should return true iff the candidate block is
       stops the ray, false if the block transmits the ray */
@@ -837,12 +881,16 @@ namespace Stg
     static void UpdateCb( World* world);
     static unsigned int next_id; ///<initially zero, used to allocate unique sequential world ids
 	 
-    bool destroy;
+    bool destroy; ///< iff true, the worker threads stop at the next update
     bool dirty; ///< iff true, a gui redraw would be required
 	 
 	 /** Pointers to all the models in this world. */
 	 std::set<Model*> models;
 
+	 /** True while Load() creates the models. Static models are not
+		  mapped until they are all loaded. */
+	 bool loading;
+
 	 /** pointers to the models that make up the world, indexed by name. */
 	 std::map<std::string, Model*> models_by_name; 		
 
@@ -853,36 +901,40 @@ namespace Stg
 		  avoids searching the whole world for fiducials. */
 	 ModelPtrVec models_with_fiducials;
 		
-		struct ltx
-		{
-			bool operator()(const Model* a, const Model* b) const;
-		};
-		
-		struct lty
-		{
-			bool operator()(const Model* a, const Model* b) const;
-		};
-		
-		/** maintain a set of models with fiducials sorted by pose.x, for
-				quickly finding nearby fidcucials */
-		std::set<Model*,ltx> models_with_fiducials_byx;
-		
-		/** maintain a set of models with fiducials sorted by pose.y, for
-				quickly finding nearby fidcucials */
-		std::set<Model*,lty> models_with_fiducials_byy;
-					 
+	 /** The models in models_with_fiducials, filed by the cell of a
+		  uniform grid that their pose is in. The cells are hashed into
+		  a fixed number of buckets, so a bucket may hold models from
+		  several cells. */
+	 std::vector<ModelPtrVec> fiducial_grid;
+	 
+	 /** The size of a cell of fiducial_grid, in meters. At least the
+		  range of the longest-ranged fiducial finder, so a search
+		  touches at most 3x3 cells. */
+	 meters_t fiducial_cell_size;
+	 
+	 /** returns the cell of fiducial_grid containing a pose */
+	 point_int_t FiducialCell( const Pose& pose ) const;
+	 
+	 /** refile the models in models_with_fiducials that have moved to
+		  another cell of fiducial_grid. Called in series by the main
+		  thread after every model has moved. */
+	 void FiducialGridUpdate();
+	 
 	 /** Add a model to the set of models with non-zero fiducials, if not already there. */
-	 void FiducialInsert( Model* mod )
-	 { 
-		FiducialErase( mod ); // make sure it's not there already
-		models_with_fiducials.push_back( mod ); 
-	 }
+	 void FiducialInsert( Model* mod );
 	 
 	 /** Remove a model from the set of models with non-zero fiducials, if it exists. */
-	 void FiducialErase( Model* mod )
-	 { 
-		EraseAll( mod, models_with_fiducials );
-	 }
+	 void FiducialErase( Model* mod );
+	 
+	 /** Make sure the cells of the fiducial grid are at least range
+		  meters across. Called by fiducial finders as they load. */
+	 void FiducialRange( meters_t range );
+	 
+	 /** Append to found every model with fiducials that may be within
+		  range meters of pose, sorted by pointer. They are as of the
+		  last FiducialGridUpdate(), or since inserted. It may also
+		  find some models further away. */
+	 void FiducialsNear( const Pose& pose, meters_t range, ModelPtrVec& found ) const;
 
     double ppm; ///< the resolution of the world model in pixels per meter   
     bool quit; ///< quit this world ASAP  
@@ -890,12 +942,47 @@ namespace Stg
 	 bool show_clock; ///< iff true, print the sim time on stdout
 	 unsigned int show_clock_interval; ///< updates between clock outputs
 		
+	 /** A sense-reversing barrier for the threads that update the
+		  world. A thread arriving at the barrier spins for a while
+		  before it goes to sleep, since the others usually arrive
+		  within microseconds, and waking a sleeping thread costs more
+		  than that. */
+	 class Barrier
+	 {
+	 public:
+		Barrier();
+		
+		/** set the number of threads that meet at the barrier, and how
+			 long they spin before they sleep. Call before any thread
+			 waits. */
+		void Init( unsigned int count, usec_t spin );
+		
+		/** wait until all the threads have arrived. Each thread keeps
+			 its own sense, initially zero, and always passes the same
+			 one. */
+		void Wait( int& local_sense );
+		
+	 private:
+		unsigned int count; ///< the number of threads that meet here
+		usec_t spin; ///< how long a waiting thread spins before sleeping
+		int remaining; ///< the number of threads yet to arrive
+		int sense; ///< flipped by the last thread to arrive
+		int sleepers; ///< the number of threads asleep
+		pthread_mutex_t mutex; ///< used for sleeping where there are no futexes
+		pthread_cond_t cond; ///< used for sleeping where there are no futexes
+		
+		void Sleep( int old_sense );
+		void WakeAll();
+	 };
+	 
     pthread_mutex_t sync_mutex; ///< protect the worker thread management stuff
-		unsigned int threads_working; ///< the number of worker threads not yet finished
-    pthread_cond_t threads_start_cond; ///< signalled to unblock worker threads
-    pthread_cond_t threads_done_cond; ///< signalled by last worker thread to unblock main thread
+	 Barrier barrier; ///< where the threads meet between the stages of an update
+	 int barrier_sense; ///< the main thread's sense for the barrier
     int total_subs; ///< the total number of subscriptions to all models
-	 unsigned int worker_threads; ///< the number of worker threads to use
+	 unsigned int worker_threads; ///< the number of threads that handle the parallel event queues
+	 bool main_thread_updates; ///< iff true, the main thread is one of the worker_threads, instead of waiting for them
+	 usec_t threads_spin; ///< how long threads spin at the barrier before sleeping
+	 std::vector<pthread_t> workers; ///< the threads started by Load(), joined on destruction
     
   protected:	 
 
@@ -910,7 +997,67 @@ namespace Stg
 	 std::list<float*> ray_list;///< List of rays traced for debug visualization
     usec_t sim_time; ///< the current sim time in this world in microseconds
 	 std::map<point_int_t,SuperRegion*> superregions;
-    SuperRegion* sr_cached; ///< The last superregion looked up by this world
+
+	 /** A dense array of superregion pointers covering a rectangle of
+		  superregion coordinates, for constant-time lookups. */
+	 class SuperRegionGrid
+	 {
+	 public:
+		point_int_t origin; ///< coordinates of the bottom left entry
+		int32_t width, height; ///< size of the grid in superregions
+		std::vector<SuperRegion*> entries;
+
+		SuperRegionGrid( const point_int_t& origin, int32_t width, int32_t height ) 
+		  : origin(origin), width(width), height(height), entries( width*height, (SuperRegion*)NULL )
+		{}
+		
+		/** Returns a pointer to the entry for the superregion
+			 coordinates, or NULL if they are outside the grid. */
+		SuperRegion** Entry( const point_int_t& sup )
+		{
+		  const uint32_t x( sup.x - origin.x );
+		  const uint32_t y( sup.y - origin.y );
+		  return( (x < (uint32_t)width && y < (uint32_t)height) ? &entries[ x + y * width ] : NULL );
+		}
+	 };
+
+	 /** Index of the superregions, grown to cover each new superregion
+		  as it is created. */
+	 SuperRegionGrid* sr_grid; 
+
+	 /** Grids replaced by a larger one. Other threads may still be
+		  reading them, so they are kept until the world is destroyed. */
+	 std::vector<SuperRegionGrid*> sr_grids_retired;
+
+	 /** True iff some superregion was too far from the others to be
+		  indexed by sr_grid, so lookups outside the grid must search the
+		  superregions map. */
+	 bool sr_grid_overflow;
+
+	 /** Add a new superregion to sr_grid, growing the grid if needed. */
+	 void IndexSuperRegion( SuperRegion* sr );
+
+	 /** If true, a distance field of the static layer is built after
+		  loading, which lets rays step over the cells far from any
+		  static block. */
+	 bool distance_field;
+
+	 /** Find the clearance of every cell of the regions that have
+		  cells, from the static layer as it is now. */
+	 void BuildDistanceField();
+	 
+	 /** Throw the distance field away, as it is out of date. */
+	 void FreeDistanceField();
+
+	 /** Trace a single ray. If skip_origin is true the caller has
+		  already tested the blocks in the ray's origin cell, so the walk
+		  starts at the next cell. */
+	 RaytraceResult TraceRay( const Ray& ray, const bool skip_origin );
+
+	 /** As TraceRay() above, but with the cosine and sine of the
+		  ray's heading given, so they need not be computed again. */
+	 RaytraceResult TraceRay( const Ray& ray, double cosa, double sina, 
+									  const bool skip_origin );
 	 
 	 std::vector<ModelPtrVec> update_lists;  
 	 
@@ -969,8 +1116,26 @@ namespace Stg
 
     virtual Model* RecentlySelectedModel() const { return NULL; }
 		
-		/** call Cell::AddBlock(block) for each cell on the polygon */
+		/** call Cell::AddBlock(block) for each cell on the polygon, or
+				inside it if fill is true, and record the runs of cells in
+				the block */
     void MapPoly( const PointIntVec& poly,
+									Block* block,
+									unsigned int layer,
+									bool fill );
+
+		/** call Cell::AddBlock(block) once for each cell on or, if fill
+				is true, inside any of the polygons of poly_size points that
+				make up pts, and record the runs of cells in the block */
+		void MapPolys( const PointIntVec& pts,
+									 size_t poly_size,
+									 Block* block,
+									 unsigned int layer,
+									 bool fill );
+
+		/** call Cell::AddBlock(block) for the cells x0 to x1 inclusive
+				in row y, and record the runs of cells in the block */
+		void MapSpan( int32_t x0, int32_t x1, int32_t y,
 									Block* block,
 									unsigned int layer );
 
@@ -1001,6 +1166,34 @@ namespace Stg
 	 /** trace a ray. */
 	 RaytraceResult Raytrace( const Ray& ray );
 
+	 /** Trace a fan of sample_count rays sharing the origin, range and
+		  predicate of ray, spread evenly over fov and centred on the
+		  heading of ray. The origin cell is tested once for the whole
+		  fan. Results are written into samples, which must have room
+		  for sample_count entries. If dirs is not NULL, it holds the
+		  direction of each ray relative to the heading of ray, as
+		  filled in by FanDirections(), so the fan needs no trig
+		  functions per ray. */
+	 void RaytraceFan( const Ray& ray,
+							 const radians_t fov,
+							 RaytraceResult* samples,
+							 const uint32_t sample_count,
+							 const point_t* dirs = NULL );
+
+	 /** Fill in dirs with the direction of each of the sample_count
+		  rays of a fan over fov, relative to its centre, as the cosine
+		  and sine of its angle in x and y. Sensors with a fixed fan do
+		  this once and pass the result to RaytraceFan(). */
+	 static void FanDirections( const radians_t fov,
+										 const uint32_t sample_count,
+										 std::vector<point_t>& dirs );
+
+	 /** Build or throw away the distance field of the static layer,
+		  as the distance_field worldfile property does after loading.
+		  Rays trace the same either way, so this is for comparing the
+		  two. */
+	 void SetDistanceField( bool enable );
+
     RaytraceResult Raytrace( const Pose& pose, 			 
 												const meters_t range,
 												const ray_test_func_t func,
@@ -1056,13 +1249,106 @@ namespace Stg
 			/** order by time. Break ties by value of Model*, then cb*. 
 					@param event to compare with this one. */
       bool operator<( const Event& other ) const;
+			
+			/** returns true iff both events are updates of models of the
+					same type, which can be handled together in a batch. */
+			bool SameBatch( const Event& other ) const;
+			
+			/** order for batching: events that can't be batched first,
+					then updates grouped by the type of model. */
+			bool BatchLess( const Event& other ) const;
     };
 	 
-		/** Queue of pending simulation events for the main thread to handle. */
-	 std::vector<std::priority_queue<Event> > event_queues;
+	 /** A queue of pending simulation events. By default it's a
+		  heap, but it can be a timing wheel with a slot for each
+		  World::Update(), which makes adding an event and taking the
+		  events due at an update O(1). Events more than a turn of the
+		  wheel away wait on the heap until the wheel comes round. */
+	 class EventQueue
+	 {
+	 public:
+		EventQueue();
+		
+		/** use a timing wheel with slots tick usec apart, if wheel is
+			 true, or just the heap otherwise. Call while the queue is
+			 empty. */
+		void Init( bool wheel, usec_t tick );
+		
+		void Push( const Event& ev );
+		
+		/** move every event that occurs at time or earlier onto the
+			 end of due, in the order they should be handled. */
+		void PopDue( usec_t time, std::vector<Event>& due );
+		
+	 private:
+		/** the events if we're not a wheel, or those beyond the wheel's
+			 horizon if we are */
+		std::priority_queue<Event> heap;
+		
+		/** the wheel's slots, if we are one. Slot i holds the events
+			 for the ticks that equal i modulo the number of slots. */
+		std::vector<std::vector<Event> > slots;
+		
+		usec_t tick; ///< the time between the wheel's slots
+		usec_t next_tick; ///< the first tick whose events haven't been taken
+		
+		/** returns the tick an event that occurs at time is due at */
+		usec_t TickOf( usec_t time ) const
+		{ return( (time + tick - 1) / tick ); }
+		
+		/** move the events on the heap that fit on the wheel now
+			 onto it */
+		void RefillFromHeap();
+	 };
+	 
+	 /** Queues of pending simulation events. The main thread handles
+		  queue 0 in series, and all the threads share the others. */
+	 std::vector<EventQueue> event_queues;
 
-		/** Queue of pending simulation events for the main thread to handle. */
-		std::vector<std::queue<Model*> > pending_update_callbacks;
+		/** For each thread, the models whose update callbacks are
+				waiting for the main thread to call them, in order. */
+		std::vector<ModelPtrVec> pending_update_callbacks;
+		
+	 /** The events a thread has taken from its event queue to
+		  handle this update. The owner handles events from the back,
+		  and threads that have run out of events of their own steal
+		  them from the front. */
+	 class TaskDeque
+	 {
+	 public:
+		std::vector<Event> events;
+		size_t front, back; ///< the events not yet handled are [front,back)
+		pthread_mutex_t mutex; ///< protects front and back
+		
+		std::vector<Event> taken; ///< the events the owner is handling now
+		ModelPtrVec batch; ///< the models of a batch the owner is updating
+		std::vector<Event> scratch; ///< working space for GroupBatches()
+		
+		TaskDeque() : events(), front(0), back(0), mutex(), taken(), batch(), scratch() {}
+		
+		/** take the last event, and up to max-1 more before it in the
+			 same batch, onto the end of taken. Returns false if there
+			 are none left. */
+		bool PopBack( std::vector<Event>& taken, size_t max );
+		
+		/** take the first event, and up to max-1 more after it in the
+			 same batch, onto the end of taken. Returns false if there
+			 are none left. */
+		bool PopFront( std::vector<Event>& taken, size_t max );
+	 };
+	 
+	 /** One TaskDeque for each event queue. Queue 0 is handled in
+		  series by the main thread, which uses only its events. */
+	 std::vector<TaskDeque> task_deques;
+	 
+	 /** The worker event queue to be given to the next model that
+		  starts up. */
+	 unsigned int next_event_queue;
+	 
+	 /** If true, the updates due at the same time are grouped by the
+		  type of model, and each group is handed to the type's
+		  Model::update_batch function. */
+	 bool batch_updates;
 		
 		/** Create a new simulation event to be handled in the future.
 
@@ -1076,13 +1362,70 @@ namespace Stg
 				called at the specified time.
 		*/
 		void Enqueue( unsigned int queue_num, usec_t delay, Model* mod, model_callback_t cb, void* arg )
-		{  event_queues[queue_num].push( Event( sim_time + delay, mod, cb, arg ) ); }
+		{  event_queues[queue_num].Push( Event( sim_time + delay, mod, cb, arg ) ); }
 		
 		/** Set of models that require energy calculations at each World::Update(). */
 	 std::set<Model*> active_energy;
 
 		/** Set of models that require their positions to be recalculated at each World::Update(). */
 	 std::set<Model*> active_velocity;
+
+	 /** A model to be moved this update, and the box of pixels its
+		  Move() can touch. */
+	 class PlannedMove
+	 {
+	 public:
+		Model* mod;
+		point_int_t min, max; ///< the box of pixels Move() can touch
+		point_int_t tile; ///< the tile containing the box
+		bool parallel; ///< true iff the model can move in parallel
+		
+		PlannedMove( Model* mod ) 
+		  : mod(mod), min(), max(), tile(), parallel(false) {}
+		
+		/** order by tile, then in the order of active_velocity */
+		bool operator<( const PlannedMove& other ) const
+		{ 
+		  return( tile < other.tile || 
+					 (tile == other.tile && mod < other.mod )); 
+		}
+		
+		bool Overlaps( const PlannedMove& other ) const
+		{
+		  return( min.x <= other.max.x && other.min.x <= max.x &&
+					 min.y <= other.max.y && other.min.y <= max.y );
+		}
+	 };
+	 
+	 /** The models from active_velocity that have a velocity this
+		  update, in the same order. */
+	 std::vector<PlannedMove> planned_moves;
+	 
+	 /** Scratch space for PlanMoves(), kept between updates to avoid
+		  reallocating it: the moves that might be parallel sorted by
+		  tile, and the serial moves still to be checked for overlaps. */
+	 std::vector<PlannedMove*> tiled_moves, move_work;
+	 
+	 /** The models that can be moved in parallel this update, sorted
+		  by the tile of the world they move within. A model's Move()
+		  touches only cells in its tile, and no other model's Move()
+		  touches the same cells, so each tile's models are moved in
+		  series by one thread, and different tiles by different
+		  threads. */
+	 std::vector<Model*> parallel_moves;
+	 
+	 /** The index of the first model of each tile in parallel_moves,
+		  followed by the size of parallel_moves. */
+	 std::vector<size_t> move_tiles;
+	 
+	 /** The next tile in move_tiles to be claimed by a thread. Protected
+		  by sync_mutex. */
+	 size_t next_move_tile;
+	 
+	 /** The models that could interfere with others when they move,
+		  in the order of active_velocity. They are moved in series by
+		  the main thread, after the parallel moves. */
+	 std::vector<Model*> serial_moves;
 		
 	 /** The amount of simulated time to run for each call to Update() */
 	 usec_t sim_interval;
@@ -1095,9 +1438,49 @@ namespace Stg
 	 /** consume events from the queue up to and including the current sim_time */
 	 void ConsumeQueue( unsigned int queue_num );
 
+	 /** put the events that can be handled in one batch next to each
+		  other, if batch_updates is set, using scratch as working
+		  space */
+	 void GroupBatches( std::vector<Event>& events, 
+							  std::vector<Event>& scratch ) const;
+	 
+	 /** handle the events in order, passing each run of updates of
+		  models of the same type to their type's update_batch
+		  function. batch is for the function's argument. */
+	 void HandleEvents( const std::vector<Event>& events, ModelPtrVec& batch );
+
+	 /** consume events from a parallel queue up to and including the
+		  current sim_time, then help the other threads with theirs
+		  until there are none left. If the main thread updates models
+		  it owns queue 1, and each worker thread one of the rest. */
+	 void ConsumeTasks( unsigned int queue_num );
+
+	 /** the part of Update() done by every thread: move the models
+		  and handle the events of the parallel queues, meeting the
+		  other threads at the barrier in between. The main thread
+		  passes queue 1, or 0 if it only waits for the others.
+		  Returns false, having done nothing, if the world is being
+		  destroyed.*/
+	 bool UpdateModels( unsigned int queue_num, int& sense );
+
+	 /** sort the models in active_velocity into parallel_moves and
+		  serial_moves, before the threads start. Moving the models
+		  this way has exactly the same result as moving them all in
+		  series. */
+	 void PlanMoves();
+	 
+	 /** claim tiles of parallel_moves and move their models, until
+		  there are none left. Called by every thread. */
+	 void ConsumeMoves();
+	 
+	 /** the main thread's work after the parallel moves, while the
+		  other threads wait: move the models in serial_moves, and
+		  update the fiducial grid */
+	 void FinishMoves();
+
 	 /** returns an event queue index number for a model to use for
 		  updates */
-	 unsigned int GetEventQueue( Model* mod ) const;
+	 unsigned int GetEventQueue( Model* mod );
 
   public:
     /** returns true when time to quit, false otherwise */
@@ -1135,6 +1518,12 @@ namespace Stg
 				filename.  @param Filename to save as. */
     virtual bool Save( const char* filename );
 
+		/** Save a compiled copy of the worldfile alongside it, which
+				Load() reads instead of parsing the worldfile and decoding
+				its bitmaps, for as long as none of those files change.
+				Returns true on success. */
+		bool Compile();
+
 		/** Run one simulation timestep. Advances the simulation clock,
 				executes all simulation updates due at the current time, then
 				queues up future events. */
@@ -1208,16 +1597,40 @@ namespace Stg
 					 bool inherit_color,
 					 bool wheel );
 		
+    /** Construct a single block made of several rectangles, such
+				as the many rectangles found in a bitmap, so that they share
+				one set of caches and each cell holds the block only once. */
+    Block( Model* mod,  
+					 const std::vector<rotrect_t>& rects,
+					 meters_t zmin,
+					 meters_t zmax,
+					 Color color,
+					 bool inherit_color );
+		
     /** A from-file  constructor */
     Block(  Model* mod,  Worldfile* wf, int entity);
 		
     ~Block();
 	 
-    /** render the block into the world's raytrace data structure */
+    /** render the block into the world's raytrace data structure. If
+				the block is already rendered into this layer at the same
+				pixels, nothing needs to be done. */
     void Map( unsigned int layer ); 	 
 	 
     /** remove the block from the world's raytracing data structure */
     void UnMap( unsigned int layer );	 
+
+		/** Expand the box [min,max] to include the pixels this block
+				is rendered into in the layer, and every pixel it can reach
+				if its model moves by up to reach pixels and turns by up to
+				turn radians about origin, in pixels. Returns false if the
+				block is not rendered into the layer. */
+		bool ExpandMoveBounds( unsigned int layer, 
+													 const point_t& origin, 
+													 double reach, 
+													 double turn,
+													 point_int_t& min, 
+													 point_int_t& max );
 	 	 
 	 /** draw the block in OpenGL as a solid single color */    
 	 void DrawSolid(bool topview);
@@ -1263,6 +1676,13 @@ namespace Stg
 	 std::vector<point_t> mpts; ///< cache of this->pts in model coordindates
     size_t pt_count; ///< the number of points	 
 	 std::vector<point_t> pts; ///< points defining a polygonx	 
+		
+		/** true if pts holds the four corners of each of several
+				rectangles, rather than one polygon */
+		bool rect_set;
+		
+		/** the number of points in each polygon in pts */
+		size_t PolySize() const { return( rect_set ? 4 : pts.size() ); }
     Size size;	 
     Bounds local_z; ///<  z extent in local coords
     Color color;
@@ -1279,10 +1699,17 @@ namespace Stg
 		/** record the list entries for the cells where this block is rendered */
 		std::vector< std::list<Block*>::iterator > list_entries;
 		
-    /** record the cells into which this block has been rendered to
-				UnMapping them very quickly. */  
-		CellPtrVec rendered_cells[2];
+    /** record the runs of cells into which this block has been
+				rendered to UnMapping them very quickly. */  
+		CellSpanVec rendered_spans[3];
 		
+		/** the global pixel coords of the block's points when it was
+				rendered into each layer. If they have not changed, neither
+				have the cells. */
+		PointIntVec rendered_pts[3];
+
+	 /** scratch space for the global pixel coords of the block's
+		  points, kept between updates to avoid reallocating it */
 	 PointIntVec gpts;
 	
 	 /** find the position of a block's point in model coordinates
@@ -1740,6 +2167,10 @@ namespace Stg
 		/** records if this model has been mapped into the world bitmap*/
 		bool mapped;
 
+		/** records if this model is mapped into the world's static
+			 layer rather than the double-buffered layers */
+		bool mapped_static;
+
 	 std::vector<Option*> drawOptions;
 	 const std::vector<Option*>& getOptions() const { return drawOptions; }
 	 
@@ -1853,6 +2284,10 @@ namespace Stg
 
 		/** Container for flags attached to this model. */
 	 std::list<Flag*> flag_list;
+
+	 /** If true, the interiors of this model's blocks are filled in
+		  the occupancy grid, rather than just their outlines. */
+	 bool fill_blocks;
 		
 		/** Model the interaction between the model's blocks and the
 				surface they touch. @todo primitive at the moment */
@@ -1896,6 +2331,11 @@ namespace Stg
 		  global coordinate frame is the parent is NULL. */
 	 Pose pose;
 
+	 /** The pose of the model in the global coordinate frame, kept up
+		  to date by UpdateGlobalPose() whenever pose changes, or
+		  anything else it depends on. */
+	 Pose global_pose;
+
 	 /** Optional attached PowerPack, defaults to NULL */
 	 PowerPack* power_pack;
 
@@ -1944,6 +2384,13 @@ namespace Stg
 		  allow parallel Updates(). */
 	 bool thread_safe;
 	 
+	 /** The function that updates a batch of models of this model's
+		  type, when the world batches updates. Defaults to
+		  Model::UpdateBatch(). Derived classes that can update many
+		  models faster together than one at a time can set their own
+		  in their constructor. */
+	 update_batch_t update_batch;
+	 
 	 /** Cache of recent poses, used to draw the trail. */
 	 class TrailItem 
 	 {																							
@@ -1981,6 +2428,7 @@ namespace Stg
 	 /** The index into the world's vector of event queues. Initially
 			 -1, to indicate that it is not on a list yet. */
 		unsigned int event_queue_num; 
+		point_int_t fiducial_cell; ///< the cell of the world's fiducial grid we're filed under
 		bool used;   ///< TRUE iff this model has been returned by GetUnusedModelOfType()  
 		Velocity velocity;
 		
@@ -2069,8 +2517,43 @@ namespace Stg
 	 void Map( unsigned int layer );
 	 void UnMap( unsigned int layer );
 
+	 /** Move this model's blocks from the double-buffered layers into
+		  the world's static layer, where they stay until the model is
+		  next unmapped. */
+	 void MapStatic();
+
+	 /** Returns true iff neither this model nor any of its ancestors
+		  has its velocity enabled, so it should never move by itself. */
+	 bool IsStatic() const;
+
 	 void MapWithChildren( unsigned int layer );
 	 void UnMapWithChildren( unsigned int layer );
+
+	 /** Recalculate the global pose of this model and its
+		  descendents. Call after changing the pose, parent or geometry
+		  of the model. */
+	 void UpdateGlobalPose();
+
+	 /** Update the layer to show this model and its descendents at
+		  their current poses, without unmapping the blocks that have
+		  not moved by a whole pixel since they were last mapped. */
+	 void RemapWithChildren( unsigned int layer );
+
+	 /** Find the box [min,max] of pixels that Move() can touch in the
+		  layer this update: where this model and its descendents are
+		  rendered now, and everywhere they can reach at the model's
+		  current velocity. Returns false if this can't be worked out,
+		  e.g. if the model is not mapped into the layer. */
+	 bool GetMoveBounds( unsigned int layer, point_int_t& min, point_int_t& max );
+
+	 /** Recursive part of GetMoveBounds(), for the descendents being
+		  carried by a moving model. */
+	 bool ExpandMoveBounds( unsigned int layer, 
+									const point_t& origin, 
+									double reach, 
+									double turn,
+									point_int_t& min, 
+									point_int_t& max );
   
 	 // Find the root model, and map/unmap the whole tree.
 	 void MapFromRoot( unsigned int layer );
@@ -2117,6 +2600,10 @@ namespace Stg
 		virtual void UpdateCharge();
 		
 		static int UpdateWrapper( Model* mod, void* arg ){ mod->Update(); return 0; }
+		
+		/** Update each of the models, which are all of the same type,
+			 in order. The default update_batch function. */
+		static void UpdateBatch( const ModelPtrVec& models );
 		static int MoveWrapper( Model* mod, void* arg ){ mod->Move(); return 0; }
 
 		/** Calls CallCallback( CB_UPDATE ) */
@@ -2279,7 +2766,7 @@ namespace Stg
 	 bool IsRelated( const Model* testmod ) const;
 
 	 /** get the pose of a model in the global CS */
-	 Pose GetGlobalPose() const;
+	 Pose GetGlobalPose() const { return global_pose; }
 	
 	 /** get the velocity of a model in the global CS */
 	 Velocity GetGlobalVelocity()  const;
@@ -2478,6 +2965,10 @@ namespace Stg
   private:
 	 std::vector<Blob> blobs;
 	 std::vector<Color> colors;
+	 
+	 /** the raytrace results of the latest scan, kept between
+		  updates to avoid reallocating them */
+	 std::vector<RaytraceResult> samples;
 
 	 // predicate for ray tracing
 	 static bool BlockMatcher( Block* testblock, Model* finder );
@@ -2684,6 +3175,9 @@ namespace Stg
 	 static Option showFov;
 	 
 	 std::vector<Fiducial> fiducials;
+	 
+	 /** the fiducial-bearing models near enough to check this update */
+	 ModelPtrVec nearby;
 		
   public:		
 	 ModelFiducial( World* world, 
@@ -2754,6 +3248,12 @@ namespace Stg
 			
 			std::vector<meters_t> ranges;
 			std::vector<double> intensities;
+			std::vector<RaytraceResult> samples; ///< raytrace results from the last update
+			
+			/** the direction of each sample relative to the sensor, for
+					World::RaytraceFan(), and the fov they were made for */
+			std::vector<point_t> directions;
+			radians_t directions_fov;
 			
 			Sensor() : pose( 0,0,0,0 ), 
 								 size( 0.02, 0.02, 0.02 ), // teeny transducer
@@ -2762,7 +3262,10 @@ namespace Stg
 								 sample_count(1),
 								 col( 0,1,0,0.3 ),
 								 ranges(),
-								 intensities()
+								 intensities(),
+								 samples(),
+								 directions(),
+								 directions_fov( 0 )
 			{}
 			
 			void Update( ModelRanger* rgr );			
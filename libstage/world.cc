@@ -17,12 +17,17 @@
     @verbatim
 
 	 name                     <worldfile name>
+	 batch_updates             0
+	 distance_field            0
 	 interval_sim            100
 	 quit_time                 0
     resolution                0.02
 	 show_clock                0
 	 show_clock_interval     100
 	 threads                   1
+	 threads_spin              0.05
+	 timing_wheel              0
+	 update_threads            1
 
     @endverbatim
 
@@ -32,6 +37,21 @@
 	 An identifying name for the world, used e.g. in the title bar of
 	 the GUI.
 
+    - batch_updates <int>\n
+	 If non-zero, the model updates due at the same time are grouped
+	 by type of model, and each group is updated together by a
+	 function for that type, instead of the updates of different
+	 types being interleaved. Types of model can provide a function
+	 that is faster for many models than updating them one at a time.
+
+    - distance_field <int>\n
+	 If non-zero, find the distance from each cell of the map to the
+	 nearest block of a model that never moves by itself, such as a
+	 floorplan, after loading the world. Rays then step over the
+	 cells they can't hit anything in, instead of looking at each
+	 one, in parts of the map with no moving models. This can help
+	 long-range sensors in worlds with large, sparse static maps.
+
     - interval_sim <float>\n
 	 The amount of simulation time run for each call of
 	 World::Update(). Each model has its own configurable update
@@ -61,14 +81,47 @@
 	 if $show_clock is enabled. The default is once every 10 simulated
 	 seconds. Smaller values slow the simulation down a little.
 
-    - threads <int>\n The number of worker threads to spawn. Some
+    - threads <int>\n The number of worker threads to spawn. The main
+    thread waits while they update the models. Some
     models can be updated in parallel (e.g. laser, ranger), and
     running 2 or more threads here may make the simulation run faster,
     depending on the number of CPU cores available and the
     worldfile. As a guideline, use one thread per core if you have
     parallel-enabled high-resolution models, e.g. a laser with
     hundreds or thousands of samples, or lots of models. Defaults to
-    1. Values of less than 1 will be forced to 1.
+    1. Values of less than 1 will be forced to 1. Compatibility
+    note: for a while threads counted the main thread as well, so
+    that threads N spawned N-1 worker threads and threads 1 spawned
+    none. It has gone back to meaning the number of worker threads,
+    and that count including the main thread is now given by
+    update_threads.
+
+    - threads_spin <float>\n
+	 The time in msec a thread waits for the others by spinning on a
+	 CPU core, before it goes to sleep, at each of the few points in
+	 an update where the threads must wait for each other. Spinning
+	 makes the hand-over between threads much faster than waking a
+	 sleeping thread, which matters in small worlds with short
+	 interval_sim. Set 0 to sleep at once. If there are more threads
+	 than CPU cores, threads never spin.
+
+    - update_threads <int>\n
+	 The number of threads that update models, including the main
+	 thread, which works alongside the others instead of waiting for
+	 them as it does with threads. update_threads 1 spawns no extra
+	 threads and updates everything in the main thread. That is what
+	 happens if neither update_threads nor threads is given, and it
+	 gives the same results as threads 1 without handing each update
+	 over to another thread. Overrides threads. Values of less than 1
+	 will be forced to 1.
+
+    - timing_wheel <int>\n
+	 If non-zero, keep the pending model updates on a timing wheel
+	 with a slot for each interval_sim, instead of in a heap. Adding
+	 an update and finding the updates due are then constant-time, so
+	 the time spent scheduling doesn't grow with the number of
+	 models. Updates that are due at the same time may be handled in
+	 a different order than with the heap.
 	 
     @par More examples
     The Stage source distribution contains several example world files in
@@ -88,6 +141,11 @@
 #include <locale.h> 
 #include <limits.h>
 #include <libgen.h> // for dirname(3)
+#include <typeinfo> // for typeid
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h> // for syscall(2) and SYS_futex
+#endif
 
 #include "stage.hh"
 #include "file_manager.hh"
@@ -96,18 +154,14 @@
 #include "option.hh"
 using namespace Stg;
 
-// // function objects for comparing model positions
-bool World::ltx::operator()(const Model* a, const Model* b) const
-{
-  const meters_t ax( a->GetGlobalPose().x );
-  const meters_t bx( b->GetGlobalPose().x );  
-  return ( ax == bx ? a < b : ax < bx );
-}
-bool World::lty::operator()(const Model* a, const Model* b) const
+// the number of buckets in the fiducial grid. A power of two.
+static const size_t FIDUCIAL_BUCKETS( 4096 );
+
+// returns the index of the bucket of the fiducial grid holding a cell
+static inline size_t FiducialHash( const point_int_t& cell )
 {
-  const meters_t ay( a->GetGlobalPose().y );
-  const meters_t by( b->GetGlobalPose().y );  
-  return ( ay == by ? a < b : ay < by );
+  return( ((unsigned int)cell.x * 73856093U ^ (unsigned int)cell.y * 19349663U)
+			 & (FIDUCIAL_BUCKETS-1) );
 }
 
 // static data members
@@ -124,20 +178,23 @@ World::World( const std::string& name,
   destroy( false ),
   dirty( true ),
   models(),
+  loading(false),
   models_by_name(),
   models_with_fiducials(),
-  models_with_fiducials_byx(),
-  models_with_fiducials_byy(),
+  fiducial_grid( FIDUCIAL_BUCKETS ),
+  fiducial_cell_size( 1.0 ),
   ppm( ppm ), // raytrace resolution
   quit( false ),
   show_clock( false ),
   show_clock_interval( 100 ), // 10 simulated seconds using defaults
   sync_mutex(),
-  threads_working( 0 ),
-  threads_start_cond(),
-  threads_done_cond(),
+  barrier(),
+  barrier_sense( 0 ),
   total_subs( 0 ), 
   worker_threads( 1 ),
+  main_thread_updates( true ),
+  threads_spin( 50 ),
+  workers(),
 
   // protected
   cb_list(),
@@ -149,14 +206,27 @@ World::World( const std::string& name,
   ray_list(),  
   sim_time( 0 ),
   superregions(),
-  sr_cached(NULL),
+  sr_grid(NULL),
+  sr_grids_retired(),
+  sr_grid_overflow(false),
+  distance_field(false),
   updates( 0 ),
   wf( NULL ),
   paused( false ),
   event_queues(1), // use 1 thread by default
 	pending_update_callbacks(),
+	task_deques(),
+	next_event_queue(0),
+	batch_updates(false),
 	active_energy(),
 	active_velocity(),
+	planned_moves(),
+	tiled_moves(),
+	move_work(),
+	parallel_moves(),
+	move_tiles(),
+	next_move_tile(0),
+	serial_moves(),
   sim_interval( 1e5 ), // 100 msec has proved a good default
 	update_cb_count(0)
 {
@@ -167,8 +237,7 @@ World::World( const std::string& name,
     }
  
   pthread_mutex_init( &sync_mutex, NULL );
-  pthread_cond_init( &threads_start_cond, NULL );
-  pthread_cond_init( &threads_done_cond, NULL );
+  barrier.Init( worker_threads, threads_spin );
  
   World::world_set.insert( this );
   
@@ -183,8 +252,33 @@ World::World( const std::string& name,
 World::~World( void )
 {
   PRINT_DEBUG2( "destroying world %d %s", id, token.c_str() );
+
+  // release the worker threads from the barrier they are waiting at,
+  // and wait for them to stop
+  if( workers.size() )
+	 {
+		destroy = true;
+		barrier.Wait( barrier_sense );
+		FOR_EACH( it, workers )
+		  pthread_join( *it, NULL );
+	 }
+
   if( ground ) delete ground;
+
+  // each model takes itself out of the world as it goes, so delete
+  // them while the world is still whole
+  while( children.size() )
+	 delete children.front();
+
+  FOR_EACH( it, superregions )
+	 delete it->second;
+  
   if( wf ) delete wf;
+
+  if( sr_grid ) delete sr_grid;
+  FOR_EACH( it, sr_grids_retired )
+	 delete *it;
+
   World::world_set.erase( this );
 }
 
@@ -192,6 +286,7 @@ SuperRegion* World::CreateSuperRegion( point_int_t origin )
 {
   SuperRegion* sr( new SuperRegion( this, origin ) );
   superregions[origin] = sr;
+  IndexSuperRegion( sr );
   dirty = true; // force redraw
   return sr;
 }
@@ -199,9 +294,212 @@ SuperRegion* World::CreateSuperRegion( point_int_t origin )
 void World::DestroySuperRegion( SuperRegion* sr )
 {
   superregions.erase( sr->GetOrigin() );
+
+  SuperRegion** entry( sr_grid ? sr_grid->Entry( sr->GetOrigin() ) : NULL );
+  if( entry ) 
+	 *entry = NULL;
+  
   delete sr;
 }
 
+void World::IndexSuperRegion( SuperRegion* sr )
+{
+  const point_int_t& sup( sr->GetOrigin() );
+  
+  SuperRegion** entry( sr_grid ? sr_grid->Entry( sup ) : NULL );
+  if( entry )
+	 {
+		*entry = sr;
+		return;
+	 }
+
+  // the grid must grow to cover the bounding box of the old grid and
+  // the new superregion. Old grids are kept until the world is
+  // destroyed, since other threads may still be looking in them, so
+  // grow by at least the old size on each side that needs it. The
+  // grid then doubles, and regrows only a few times per world.
+  point_int_t lo( sup ), hi( sup );
+  point_int_t slacklo( sup ), slackhi( sup );
+  if( sr_grid )
+	 {
+		const point_int_t& o( sr_grid->origin );
+		const int32_t w( sr_grid->width );
+		const int32_t h( sr_grid->height );
+
+		lo.x = std::min( lo.x, o.x );
+		lo.y = std::min( lo.y, o.y );
+		hi.x = std::max( hi.x, o.x + w - 1 );
+		hi.y = std::max( hi.y, o.y + h - 1 );
+
+		slacklo = lo;
+		slackhi = hi;
+		if( sup.x < o.x ) slacklo.x = std::min( lo.x, o.x - w );
+		if( sup.y < o.y ) slacklo.y = std::min( lo.y, o.y - h );
+		if( sup.x > o.x + w - 1 ) slackhi.x = std::max( hi.x, o.x + 2*w - 1 );
+		if( sup.y > o.y + h - 1 ) slackhi.y = std::max( hi.y, o.y + 2*h - 1 );
+	 }
+  
+  // a superregion far away from the rest would make the grid huge and
+  // mostly empty, so leave it to be found in the map instead
+  const int64_t maxentries( 1<<16 );
+
+  if( ((int64_t)slackhi.x - slacklo.x + 1) * ((int64_t)slackhi.y - slacklo.y + 1) 
+		<= maxentries )
+	 {
+		lo = slacklo;
+		hi = slackhi;
+	 }
+
+  const int64_t width( (int64_t)hi.x - lo.x + 1 );
+  const int64_t height( (int64_t)hi.y - lo.y + 1 );
+
+  if( width * height > maxentries )
+	 {
+		sr_grid_overflow = true;
+		return;
+	 }
+
+  SuperRegionGrid* grid( new SuperRegionGrid( lo, (int32_t)width, (int32_t)height ) );
+  
+  FOR_EACH( it, superregions )
+	 {
+		entry = grid->Entry( it->first );
+		if( entry ) 
+		  *entry = it->second;
+	 }
+  
+  if( sr_grid )
+	 sr_grids_retired.push_back( sr_grid );
+  sr_grid = grid;
+}
+
+void World::BuildDistanceField()
+{
+  FreeDistanceField();
+
+  // find the box of regions that have cells, in global region
+  // coordinates. There are no static blocks outside it.
+  point_int_t lo( INT_MAX, INT_MAX ), hi( INT_MIN, INT_MIN );
+  
+  FOR_EACH( it, superregions )
+	 for( int32_t ry(0); ry<SUPERREGIONWIDTH; ++ry )
+		for( int32_t rx(0); rx<SUPERREGIONWIDTH; ++rx )
+		  if( it->second->GetRegion( rx, ry )->cells )
+			 {
+				const int32_t x( (it->first.x << SBITS) + rx );
+				const int32_t y( (it->first.y << SBITS) + ry );
+				lo.x = std::min( lo.x, x );
+				lo.y = std::min( lo.y, y );
+				hi.x = std::max( hi.x, x );
+				hi.y = std::max( hi.y, y );
+			 }
+  
+  if( lo.x > hi.x ) // nothing mapped
+	 return;
+
+  const int64_t width( ((int64_t)hi.x - lo.x + 1) * REGIONWIDTH );
+  const int64_t height( ((int64_t)hi.y - lo.y + 1) * REGIONWIDTH );
+  
+  if( width * height > (1<<28) )
+	 {
+		PRINT_WARN2( "the map is too large for a distance field (%lld x %lld cells)",
+						 (long long)width, (long long)height );
+		return;
+	 }
+  
+  // the clearance of every cell in the box, starting from zero at
+  // each cell containing static blocks
+  std::vector<uint8_t> field( width * height, 255 );
+  
+  FOR_EACH( it, superregions )
+	 for( int32_t ry(0); ry<SUPERREGIONWIDTH; ++ry )
+		for( int32_t rx(0); rx<SUPERREGIONWIDTH; ++rx )
+		  {
+			 const Region* reg( it->second->GetRegion( rx, ry ) );
+			 if( reg->cells == NULL )
+				continue;
+			 
+			 const uint32_t* rows( reg->GetOccupancy( STATIC_LAYER ) );
+			 const int64_t x0( ((it->first.x << SBITS) + rx - lo.x) * REGIONWIDTH );
+			 const int64_t y0( ((it->first.y << SBITS) + ry - lo.y) * REGIONWIDTH );
+			 
+			 for( int32_t cy(0); cy<REGIONWIDTH; ++cy )
+				for( int32_t cx(0); cx<REGIONWIDTH; ++cx )
+				  if( rows[cy] & (1U << cx) )
+					 field[ x0 + cx + (y0 + cy) * width ] = 0;
+		  }
+  
+  // the Manhattan distance transform, as rays step between cells
+  // that share an edge. Two passes, each looking at the two
+  // neighbours already visited.
+  for( int64_t y(0); y<height; ++y )
+	 for( int64_t x(0); x<width; ++x )
+		{
+		  uint8_t& d( field[ x + y * width ] );
+		  int nearest( d );
+		  if( x > 0 ) nearest = std::min( nearest, field[ x-1 + y * width ] + 1 );
+		  if( y > 0 ) nearest = std::min( nearest, field[ x + (y-1) * width ] + 1 );
+		  d = std::min( nearest, 255 );
+		}
+  
+  for( int64_t y(height-1); y>=0; --y )
+	 for( int64_t x(width-1); x>=0; --x )
+		{
+		  uint8_t& d( field[ x + y * width ] );
+		  int nearest( d );
+		  if( x < width-1 ) nearest = std::min( nearest, field[ x+1 + y * width ] + 1 );
+		  if( y < height-1 ) nearest = std::min( nearest, field[ x + (y+1) * width ] + 1 );
+		  d = std::min( nearest, 255 );
+		}
+  
+  // and hand it out to the regions
+  FOR_EACH( it, superregions )
+	 for( int32_t ry(0); ry<SUPERREGIONWIDTH; ++ry )
+		for( int32_t rx(0); rx<SUPERREGIONWIDTH; ++rx )
+		  {
+			 Region* reg( it->second->GetRegion( rx, ry ) );
+			 if( reg->cells == NULL )
+				continue;
+			 
+			 const int64_t x0( ((it->first.x << SBITS) + rx - lo.x) * REGIONWIDTH );
+			 const int64_t y0( ((it->first.y << SBITS) + ry - lo.y) * REGIONWIDTH );
+			 
+			 reg->clearance = new uint8_t[ CLEARWIDTH * CLEARWIDTH ];
+			 memset( reg->clearance, 255, CLEARWIDTH * CLEARWIDTH );
+			 
+			 for( int32_t cy(0); cy<REGIONWIDTH; ++cy )
+				for( int32_t cx(0); cx<REGIONWIDTH; ++cx )
+				  {
+					 uint8_t& c( reg->clearance[ (cx >> CLEARBITS) + (cy >> CLEARBITS) * CLEARWIDTH ] );
+					 c = std::min( c, field[ x0 + cx + (y0 + cy) * width ] );
+				  }
+		  }
+}
+
+void World::FreeDistanceField()
+{
+  FOR_EACH( it, superregions )
+	 for( int32_t r(0); r<SUPERREGIONSIZE; ++r )
+		{
+		  Region* reg( it->second->GetRegion( r % SUPERREGIONWIDTH, r / SUPERREGIONWIDTH ) );
+		  if( reg->clearance )
+			 {
+				delete[] reg->clearance;
+				reg->clearance = NULL;
+			 }
+		}
+}
+
+void World::SetDistanceField( bool enable )
+{
+  distance_field = enable;
+  
+  if( enable )
+	 BuildDistanceField();
+  else
+	 FreeDistanceField();
+}
+
 bool World::UpdateAll()
 {  
   bool quit( true );
@@ -222,36 +520,15 @@ void* World::update_thread_entry( std::pair<World*,int> *thread_info )
   World* world( thread_info->first );
   const int thread_instance( thread_info->second );
   
-  //printf( "thread ID %d waiting for mutex\n", thread_instance );
-
-  pthread_mutex_lock( &world->sync_mutex );  
-
-  while( 1 )
-    {
-      //printf( "thread ID %d waiting for start\n", thread_instance );
-      
-      // wait until the main thread signals us
-      //puts( "worker waiting for start signal" );
-      
-      pthread_cond_wait( &world->threads_start_cond, &world->sync_mutex );
-      pthread_mutex_unlock( &world->sync_mutex );
-		
-      //printf( "worker %u thread awakes for task %u\n", thread_instance, task );
-      world->ConsumeQueue( thread_instance );
-      //printf( "thread %d done\n", thread_instance );
-      
-      // done working, so increment the counter. If this was the last
-      // thread to finish working, signal the main thread, which is
-      // blocked waiting for this to happen
-      
-      pthread_mutex_lock( &world->sync_mutex );	  
-      if( --world->threads_working == 0 )
-	{
-	  //puts( "last worker signalling main thread" );
-	  pthread_cond_signal( &world->threads_done_cond );
-	}
-      // keep lock going round the loop
-    }
+  //printf( "thread ID %d waiting for start\n", thread_instance );
+  
+  delete thread_info;
+  
+  // only look at destroy between the barriers, where the main
+  // thread can't be changing it
+  int sense( 0 );
+  while( world->UpdateModels( thread_instance, sense ) )
+	 ;
   
   return NULL;
 }
@@ -394,24 +671,64 @@ void World::Load( const std::string& worldfile_path )
   this->sim_interval =
     1e3 * wf->ReadFloat( entity, "interval_sim", this->sim_interval / 1e3 );
   
-  this->worker_threads = wf->ReadInt( entity, "threads",  this->worker_threads );  
-  if( this->worker_threads < 1 )
+  const bool timing_wheel( wf->ReadInt( entity, "timing_wheel", 0 ) );
+
+  this->batch_updates = 
+	 wf->ReadInt( entity, "batch_updates", this->batch_updates );
+  
+  this->distance_field = 
+	 wf->ReadInt( entity, "distance_field", this->distance_field );
+  
+  // update_threads counts the main thread, which then updates models
+  // with the others. threads counts only the threads to spawn, and
+  // the main thread waits for them.
+  const char* threads_prop( "threads" );
+  if( wf->PropertyExists( entity, "update_threads" ) )
+	 threads_prop = "update_threads";
+  else if( wf->PropertyExists( entity, "threads" ) )
+	 this->main_thread_updates = false;
+  
+  const int threads( wf->ReadInt( entity, threads_prop, this->worker_threads ) );
+  if( threads < 1 )
     {
-      PRINT_WARN( "threads set to <1. Forcing to 1" );
+      PRINT_WARN1( "%s set to <1. Forcing to 1", threads_prop );
       this->worker_threads = 1;
     }
+  else
+	 this->worker_threads = threads;
+  
+  // read msec instead of usec: easier for user
+  this->threads_spin = 
+	 1e3 * wf->ReadFloat( entity, "threads_spin", this->threads_spin / 1e3 );
+  
+  // the threads that meet at the barrier
+  const unsigned int meeting( worker_threads + (main_thread_updates ? 0 : 1) );
+  
+  // a thread spinning without a core to itself only delays the
+  // thread it's waiting for
+  const long cores( sysconf( _SC_NPROCESSORS_ONLN ) );
+  if( cores > 0 && meeting > (unsigned int)cores )
+	 this->threads_spin = 0;
+  
+  barrier.Init( meeting, threads_spin );
   
   pending_update_callbacks.resize( worker_threads + 1 );      
   event_queues.resize( worker_threads + 1 );
+  FOR_EACH( it, event_queues )
+	 it->Init( timing_wheel, sim_interval );
+  task_deques.resize( worker_threads + 1 );
+  for( unsigned int t(0); t<task_deques.size(); ++t )
+	 pthread_mutex_init( &task_deques[t].mutex, NULL );
   
   //printf( "worker threads %d\n", worker_threads );
   
-  // kick off the threads
-  for( unsigned int t(0); t<worker_threads; ++t )
+  // kick off the threads. If the main thread updates models, it does
+  // the work of the first, so start one less.
+  for( unsigned int t( main_thread_updates ? 2 : 1 ); t<=worker_threads; ++t )
     {
       // a little configuration for each thread can't be a local
       // stack var, since it's accssed in the threads
-      std::pair<World*,int>* infop = new std::pair<World*,int>( this, t+1 );
+      std::pair<World*,int>* infop = new std::pair<World*,int>( this, t );
       
       //printf( "starting thread %d with ID %d \n", (int)t, info[t].second );
       
@@ -423,12 +740,14 @@ void World::Load( const std::string& worldfile_path )
 		      NULL,
 		      (func_ptr)World::update_thread_entry, 
 		      infop );
+      workers.push_back( pt );
     }
   
   if( worker_threads > 1 ) 
     printf( "[threads %u]", worker_threads );	
   
   // Iterate through entitys and create objects of the appropriate type
+  loading = true;
   for( int entity(1); entity < wf->GetEntityCount(); ++entity )
     {
       const char *typestr = (char*)wf->GetEntityType(entity);      	  
@@ -445,6 +764,7 @@ void World::Load( const std::string& worldfile_path )
 			else
 				LoadModel( wf, entity );
     }
+  loading = false;
   
   // call all controller init functions
   FOR_EACH( it, models )
@@ -458,6 +778,15 @@ void World::Load( const std::string& worldfile_path )
 		(*it)->InitControllers();
 	 }
 
+  // models that can not move by themselves go into the static layer,
+  // where they are mapped only once
+  FOR_EACH( it, models )
+	 if( (*it)->IsStatic() )
+		(*it)->MapStatic();
+
+  if( distance_field )
+	 BuildDistanceField();
+
   putchar( '\n' );
 }
 
@@ -546,7 +875,7 @@ void World::CallUpdateCallbacks()
 	
 	for( size_t t(0); t<threads; ++t )
 		{
-			std::queue<Model*>& q( pending_update_callbacks[t] );
+			ModelPtrVec& q( pending_update_callbacks[t] );
 			
 // 			printf( "pending callbacks for thread %u: %u\n", 
 // 							(unsigned int)t, 
@@ -554,11 +883,11 @@ void World::CallUpdateCallbacks()
 			
 			cbcount += q.size();
 
-			while( ! q.empty() )
-				{
-					q.front()->CallUpdateCallbacks();
-					q.pop();
-				}
+			// index rather than iterate, as a callback may queue more.
+			// clear() keeps the capacity for the next update.
+			for( size_t i(0); i<q.size(); ++i )
+				q[i]->CallUpdateCallbacks();
+			q.clear();
 		}
 	//	printf( "cb total %u (global %d)\n\n", (unsigned int)cbcount,update_cb_count );
 	
@@ -572,29 +901,380 @@ void World::CallUpdateCallbacks()
     }      
 }
 
+// The number of slots in a timing wheel. Most models are updated
+// every few World::Update()s, so their events always fit on the wheel.
+static const usec_t WHEEL_SLOTS( 1024 );
+
+World::EventQueue::EventQueue() :
+  heap(),
+  slots(),
+  tick( 0 ),
+  next_tick( 0 )
+{
+}
+
+void World::EventQueue::Init( bool wheel, usec_t tick )
+{
+  slots.clear();
+  next_tick = 0;
+  this->tick = 0;
+  
+  if( wheel )
+	 {
+		this->tick = std::max( tick, (usec_t)1 );
+		slots.resize( WHEEL_SLOTS );
+	 }
+}
+
+void World::EventQueue::Push( const Event& ev )
+{
+  if( slots.empty() )
+	 {
+		heap.push( ev );
+		return;
+	 }
+  
+  // an event that's already due is taken at the next PopDue()
+  const usec_t t( std::max( TickOf( ev.time ), next_tick ) );
+  
+  if( t < next_tick + WHEEL_SLOTS )
+	 slots[ t % WHEEL_SLOTS ].push_back( ev );
+  else
+	 heap.push( ev );
+}
+
+void World::EventQueue::RefillFromHeap()
+{
+  while( ! heap.empty() && TickOf( heap.top().time ) < next_tick + WHEEL_SLOTS )
+	 {
+		slots[ TickOf( heap.top().time ) % WHEEL_SLOTS ].push_back( heap.top() );
+		heap.pop();
+	 }
+}
+
+void World::EventQueue::PopDue( usec_t time, std::vector<Event>& due )
+{
+  if( slots.empty() )
+	 {
+		while( ! heap.empty() && heap.top().time <= time )
+		  {
+			 due.push_back( heap.top() );
+			 heap.pop();
+		  }
+		return;
+	 }
+  
+  // time is a whole number of ticks, so every event in the slots up
+  // to and including its tick is due
+  for( const usec_t last( time / tick ); next_tick <= last; ++next_tick )
+	 {
+		RefillFromHeap();
+		
+		std::vector<Event>& slot( slots[ next_tick % WHEEL_SLOTS ] );
+		due.insert( due.end(), slot.begin(), slot.end() );
+		slot.clear();
+	 }
+  
+  RefillFromHeap();
+}
+
 void World::ConsumeQueue( unsigned int queue_num )
 {  
-  std::priority_queue<Event>& queue( event_queues[queue_num] );
+  TaskDeque& own( task_deques[queue_num] );
+  
+  // update everything on the event queue that happens at this time or earlier
+  own.events.clear();
+  event_queues[queue_num].PopDue( sim_time, own.events );
   
-  if( queue.empty() )
-    return;
+  //printf( "event queue len %d\n", (int)own.events.size() );
   
-  //printf( "event queue len %d\n", (int)queue.size() );
+  GroupBatches( own.events, own.scratch );
+  HandleEvents( own.events, own.batch );
+}
+
+static bool BatchLess( const World::Event& a, const World::Event& b )
+{ return( a.BatchLess( b ) ); }
+
+void World::GroupBatches( std::vector<Event>& events, 
+								  std::vector<Event>& scratch ) const
+{
+  if( ! batch_updates )
+	 return;
   
-  // update everything on the event queue that happens at this time or earlier
-  do
-    {
-      Event ev( queue.top() );
-      if( ev.time > sim_time ) break;
-      queue.pop();
-			
-      //printf( "Q%d @ %llu next event ptr %p cb %p\n", queue_num, sim_time, ev.mod, ev.cb );
-      //std::string modelType = ev.mod->GetModelType();
-      //printf( "@ %llu next event <%s %llu %s>\n",  sim_time, modelType.c_str(), ev.time, ev.mod->Token() ); 
-      
-			ev.cb( ev.mod, ev.arg); // call the event's callback on the model			
-    }
-  while( !queue.empty() );
+  // usually they're grouped already
+  size_t i(1);
+  while( i<events.size() && ! BatchLess( events[i], events[i-1] ) )
+	 ++i;
+  
+  if( i >= events.size() )
+	 return;
+  
+  // otherwise merge sort them, which keeps the order of events in
+  // the same batch like std::stable_sort, but in the thread's own
+  // scratch space instead of a buffer allocated on each call
+  const size_t n( events.size() );
+  scratch.resize( n, events[0] );
+  
+  for( size_t width(1); width < n; width *= 2 )
+	 {
+		for( size_t lo(0); lo < n; lo += 2*width )
+		  {
+			 const size_t mid( std::min( lo + width, n ) );
+			 const size_t hi( std::min( lo + 2*width, n ) );
+			 std::merge( events.begin() + lo, events.begin() + mid,
+							 events.begin() + mid, events.begin() + hi,
+							 scratch.begin() + lo, BatchLess );
+		  }
+		events.swap( scratch );
+	 }
+}
+
+void World::HandleEvents( const std::vector<Event>& events, ModelPtrVec& batch )
+{
+  for( size_t i(0); i<events.size(); )
+	 {
+		const Event& ev( events[i] );
+		
+		//printf( "@ %llu next event ptr %p cb %p\n", sim_time, ev.mod, ev.cb );
+		//std::string modelType = ev.mod->GetModelType();
+		//printf( "@ %llu next event <%s %llu %s>\n",  sim_time, modelType.c_str(), ev.time, ev.mod->Token() ); 
+		
+		if( ! batch_updates || ev.cb != Model::UpdateWrapper )
+		  {
+			 ev.cb( ev.mod, ev.arg ); // call the event's callback on the model			
+			 ++i;
+			 continue;
+		  }
+		
+		batch.clear();
+		for( ; i<events.size() && events[i].SameBatch( ev ); ++i )
+		  batch.push_back( events[i].mod );
+		
+		ev.mod->update_batch( batch );
+	 }
+}
+
+World::Barrier::Barrier() :
+  count( 1 ),
+  spin( 0 ),
+  remaining( 1 ),
+  sense( 0 ),
+  sleepers( 0 ),
+  mutex(),
+  cond()
+{
+  pthread_mutex_init( &mutex, NULL );
+  pthread_cond_init( &cond, NULL );
+}
+
+void World::Barrier::Init( unsigned int count, usec_t spin )
+{
+  this->count = count;
+  this->spin = spin;
+  remaining = count;
+}
+
+void World::Barrier::Wait( int& local_sense )
+{
+  local_sense = !local_sense;
+  
+  if( __atomic_sub_fetch( &remaining, 1, __ATOMIC_ACQ_REL ) == 0 )
+	 {
+		// we're the last to arrive. Get ready for next time, then let
+		// the others go.
+		__atomic_store_n( &remaining, count, __ATOMIC_RELAXED );
+		__atomic_store_n( &sense, local_sense, __ATOMIC_SEQ_CST );
+		if( __atomic_load_n( &sleepers, __ATOMIC_SEQ_CST ) > 0 )
+		  WakeAll();
+		return;
+	 }
+  
+  if( spin > 0 )
+	 {
+		struct timeval tv;
+		gettimeofday( &tv, NULL );  // slow system call: use sparingly
+		const usec_t until( tv.tv_sec*1000000 + tv.tv_usec + spin );
+		
+		for( unsigned int i(1); 
+			  __atomic_load_n( &sense, __ATOMIC_ACQUIRE ) != local_sense; 
+			  ++i )
+		  if( i % 1024 == 0 )
+			 {
+				gettimeofday( &tv, NULL );
+				if( (usec_t)(tv.tv_sec*1000000 + tv.tv_usec) > until )
+				  break;
+			 }
+	 }
+  
+  while( __atomic_load_n( &sense, __ATOMIC_ACQUIRE ) != local_sense )
+	 Sleep( !local_sense );
+}
+
+#ifdef __linux__
+
+void World::Barrier::Sleep( int old_sense )
+{
+  __atomic_add_fetch( &sleepers, 1, __ATOMIC_SEQ_CST );
+  // returns at once if the sense has changed already
+  syscall( SYS_futex, &sense, FUTEX_WAIT_PRIVATE, old_sense, NULL, NULL, 0 );
+  __atomic_sub_fetch( &sleepers, 1, __ATOMIC_SEQ_CST );
+}
+
+void World::Barrier::WakeAll()
+{
+  syscall( SYS_futex, &sense, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+}
+
+#else
+
+void World::Barrier::Sleep( int old_sense )
+{
+  pthread_mutex_lock( &mutex );
+  __atomic_add_fetch( &sleepers, 1, __ATOMIC_SEQ_CST );
+  while( __atomic_load_n( &sense, __ATOMIC_SEQ_CST ) == old_sense )
+	 pthread_cond_wait( &cond, &mutex );
+  __atomic_sub_fetch( &sleepers, 1, __ATOMIC_SEQ_CST );
+  pthread_mutex_unlock( &mutex );
+}
+
+void World::Barrier::WakeAll()
+{
+  pthread_mutex_lock( &mutex );
+  pthread_cond_broadcast( &cond );
+  pthread_mutex_unlock( &mutex );
+}
+
+#endif
+
+bool World::TaskDeque::PopBack( std::vector<Event>& taken, size_t max )
+{
+  pthread_mutex_lock( &mutex );
+  const bool found( front < back );
+  if( found )
+	 {
+		const size_t last( --back );
+		taken.push_back( events[last] );
+		while( front < back && last - back + 1 < max && 
+				 events[back-1].SameBatch( events[last] ) )
+		  taken.push_back( events[--back] );
+	 }
+  pthread_mutex_unlock( &mutex );
+  return found;
+}
+
+bool World::TaskDeque::PopFront( std::vector<Event>& taken, size_t max )
+{
+  pthread_mutex_lock( &mutex );
+  const bool found( front < back );
+  if( found )
+	 {
+		const size_t first( front++ );
+		taken.push_back( events[first] );
+		while( front < back && front - first < max && 
+				 events[front].SameBatch( events[first] ) )
+		  taken.push_back( events[front++] );
+	 }
+  pthread_mutex_unlock( &mutex );
+  return found;
+}
+
+// The most updates a thread takes from a deque at once, when the
+// world batches updates and there are other threads to share them
+// with.
+static const size_t BATCH_SHARE( 32 );
+
+void World::ConsumeTasks( unsigned int queue_num )
+{
+  TaskDeque& own( task_deques[queue_num] );
+  
+  // take every event that happens at this time or earlier into our
+  // deque, where other threads can get at them
+  pthread_mutex_lock( &own.mutex );
+  own.events.clear();
+  event_queues[queue_num].PopDue( sim_time, own.events );
+  GroupBatches( own.events, own.scratch );
+  // handle them in queue order, from the back
+  std::reverse( own.events.begin(), own.events.end() );
+  own.front = 0;
+  own.back = own.events.size();
+  pthread_mutex_unlock( &own.mutex );
+  
+  // without batches, take one event at a time. Alone, take whole
+  // batches.
+  const size_t max( ! batch_updates ? 1 :
+						  worker_threads > 1 ? BATCH_SHARE : own.events.size() );
+  
+  unsigned int victim( queue_num );
+  
+  while( 1 )
+	 {
+		own.taken.clear();
+		
+		if( ! own.PopBack( own.taken, max ) )
+		  {
+			 // ours are all done, so steal from the other workers,
+			 // starting with the last one we stole from
+			 unsigned int tries(0);
+			 for( ; tries < worker_threads; ++tries )
+				{
+				  if( victim != queue_num && task_deques[victim].PopFront( own.taken, max ) )
+					 break;
+				  victim = victim % worker_threads + 1;
+				}
+			 
+			 if( tries == worker_threads )
+				return; // there's no work left anywhere
+		  }
+		
+		// the models' future events come to this thread, so a model
+		// is only ever on one queue, and it's only touched by the
+		// thread that owns it.
+		FOR_EACH( it, own.taken )
+		  it->mod->event_queue_num = queue_num;
+		
+		HandleEvents( own.taken, own.batch );
+	 }
+}
+
+void World::FinishMoves()
+{
+  // now nobody else is touching the layer, move the models that
+  // could interfere with each other
+  FOR_EACH( it, serial_moves )
+	 (*it)->Move();
+  
+  FiducialGridUpdate();
+}
+
+bool World::UpdateModels( unsigned int queue_num, int& sense )
+{
+  // wait for the main thread to plan the moves
+  barrier.Wait( sense );
+  
+  // or to tell us to stop
+  if( destroy )
+	 return false;
+  
+  if( ! parallel_moves.empty() )
+	 {
+		ConsumeMoves();
+		barrier.Wait( sense );
+		
+		if( ! serial_moves.empty() || ! models_with_fiducials.empty() )
+		  {
+			 if( queue_num == (main_thread_updates ? 1u : 0u) )
+				FinishMoves();
+			 
+			 barrier.Wait( sense );
+		  }
+	 }
+  
+  // every model has moved, so update the sensors. A main thread
+  // that only waits has no queue here.
+  if( queue_num > 0 )
+	 ConsumeTasks( queue_num );
+  barrier.Wait( sense );
+  return true;
 }
 
 bool World::Update()
@@ -612,52 +1292,27 @@ bool World::Update()
     }
 	
   sim_time += sim_interval; 
+
+  // zero unless Stage was built to count allocations
+  const uint64_t allocations( AllocationCount() );
 	
   
-	// rebuild the sets sorted by position on x,y axis
-	models_with_fiducials_byx.clear(); 
-	models_with_fiducials_byy.clear(); 
-	
- 	FOR_EACH( it, models_with_fiducials )
-		{
-			models_with_fiducials_byx.insert( *it ); 
-			models_with_fiducials_byy.insert( *it ); 
-		}
-
-	//printf( "x %lu y %lu\n", models_with_fiducials_byy.size(),
-	//			models_with_fiducials_byx.size() );
-
   // handle the zeroth queue synchronously in the main thread
   ConsumeQueue( 0 );
   
-  // handle all the remaining queues asynchronously in worker threads
-  if( worker_threads > 0 )
-	 {
-		pthread_mutex_lock( &sync_mutex );
-		threads_working = worker_threads; 
-		// unblock the workers - they are waiting on this condition var
-		//puts( "main thread signalling workers" );
-		pthread_cond_broadcast( &threads_start_cond );
-		pthread_mutex_unlock( &sync_mutex );		 
-		
-		// todo - take the 1th thread work here?
-		FOR_EACH( it, active_velocity )
-		  (*it)->Move();
-		
-		pthread_mutex_lock( &sync_mutex );
-		// wait for all the last update job to complete - it will
-		// signal the worker_threads_done condition var
-		while( threads_working > 0  )
-		  {
-			 //puts( "main thread waiting for workers to finish" );
-			 pthread_cond_wait( &threads_done_cond, &sync_mutex );
-		  }
-		pthread_mutex_unlock( &sync_mutex );		 
-		//puts( "main thread awakes" );
-		
-		// TODO: allow threadsafe callbacks to be called in worker
-		// threads		
-	 }
+  // decide which models can move in parallel
+  PlanMoves();
+
+  // with nothing to move in parallel, the other threads needn't
+  // wait for the main thread to finish the moves
+  if( parallel_moves.empty() )
+	 FinishMoves();
+  
+  // handle all the remaining queues in parallel with the worker threads
+  UpdateModels( main_thread_updates ? 1 : 0, barrier_sense );
+  
+  // TODO: allow threadsafe callbacks to be called in worker
+  // threads		
   
   dirty = true; // need redraw 
   
@@ -670,15 +1325,239 @@ bool World::Update()
 	 (*it)->UpdateCharge();
   
   ++updates;  
+
+  if( AllocationCount() > allocations )
+	 printf( "[update %llu made %llu heap allocations]\n",
+				(unsigned long long)updates,
+				(unsigned long long)(AllocationCount() - allocations) );
     
   return false;
 }
 
-unsigned int World::GetEventQueue( Model* mod ) const
+// Models are grouped for moving in parallel by tiles of 2^MOVE_TILE_BITS
+// pixels square. Tiles line up with regions, so that the cells of
+// two tiles never share a region, and fit exactly into superregions.
+static const int32_t MOVE_TILE_BITS( RBITS + 3 );
+
+static bool PlannedMovePtrLess( const World::PlannedMove* a, const World::PlannedMove* b )
+{ return( *a < *b ); }
+
+void World::PlanMoves()
+{
+  planned_moves.clear();
+  parallel_moves.clear();
+  move_tiles.clear();
+  serial_moves.clear();
+  next_move_tile = 0;
+  
+  const unsigned int layer( updates%2 );
+  
+  // find the box of pixels each move can touch. A model can move in
+  // parallel if it is not carried by another model, and the box is in
+  // one tile of an existing superregion, so no superregions are
+  // created.
+  bool bounded( true );
+  
+  FOR_EACH( it, active_velocity )
+	 {
+		Model* mod( *it );
+		
+		if( mod->velocity.IsZero() ) // Move() does nothing
+		  continue;
+		
+		PlannedMove move( mod );
+		
+		if( mod->parent == NULL && mod->GetMoveBounds( layer, move.min, move.max ) )
+		  {
+			 move.tile = point_int_t( move.min.x >> MOVE_TILE_BITS, 
+											  move.min.y >> MOVE_TILE_BITS );
+			 move.parallel = 
+				( move.tile == point_int_t( move.max.x >> MOVE_TILE_BITS,
+													 move.max.y >> MOVE_TILE_BITS ) &&
+				  GetSuperRegion( point_int_t( GETSREG(move.min.x), 
+														 GETSREG(move.min.y) )));
+		  }
+		else
+		  bounded = false; // this move could touch anything
+		
+		planned_moves.push_back( move );
+	 }
+  
+  std::vector<PlannedMove*>& tiled( tiled_moves );
+  tiled.clear();
+  
+  if( bounded )
+	 {
+		FOR_EACH( it, planned_moves )
+		  if( it->parallel )
+			 tiled.push_back( &*it );
+		
+		std::sort( tiled.begin(), tiled.end(), PlannedMovePtrLess );
+		
+		// A move that overlaps a serial move must be serial too, to
+		// keep the order in which they happen. That can make more
+		// moves serial, so keep going until nothing changes.
+		std::vector<PlannedMove*>& work( move_work );
+		work.clear();
+		FOR_EACH( it, planned_moves )
+		  if( ! it->parallel )
+			 work.push_back( &*it );
+		
+		while( work.size() )
+		  {
+			 const PlannedMove* serial( work.back() );
+			 work.pop_back();
+			 
+			 // check the moves in every tile the serial move touches
+			 for( int32_t ty( serial->min.y >> MOVE_TILE_BITS ); 
+					ty <= (serial->max.y >> MOVE_TILE_BITS); ++ty )
+				for( int32_t tx( serial->min.x >> MOVE_TILE_BITS ); 
+					  tx <= (serial->max.x >> MOVE_TILE_BITS); ++tx )
+				  {
+					 PlannedMove key( NULL );
+					 key.tile = point_int_t( tx, ty );
+					 
+					 for( std::vector<PlannedMove*>::iterator m( std::lower_bound( tiled.begin(), 
+																										  tiled.end(), 
+																										  &key, 
+																										  PlannedMovePtrLess ));
+							m != tiled.end() && (*m)->tile == key.tile; 
+							++m )
+						if( (*m)->parallel && (*m)->Overlaps( *serial ) )
+						  {
+							 (*m)->parallel = false;
+							 work.push_back( *m );
+						  }
+				  }
+		  }
+		
+		point_int_t tile;
+		FOR_EACH( it, tiled )
+		  if( (*it)->parallel )
+			 {
+				if( parallel_moves.empty() || !((*it)->tile == tile) )
+				  {
+					 move_tiles.push_back( parallel_moves.size() );
+					 tile = (*it)->tile;
+				  }
+				parallel_moves.push_back( (*it)->mod );
+			 }
+		move_tiles.push_back( parallel_moves.size() );
+	 }
+  
+  FOR_EACH( it, planned_moves )
+	 if( ! (bounded && it->parallel) )
+		serial_moves.push_back( it->mod );
+}
+
+void World::ConsumeMoves()
+{
+  while( 1 )
+	 {
+		pthread_mutex_lock( &sync_mutex );
+		const size_t tile( next_move_tile++ );
+		pthread_mutex_unlock( &sync_mutex );
+		
+		if( tile + 1 >= move_tiles.size() )
+		  return;
+		
+		for( size_t i(move_tiles[tile]); i<move_tiles[tile+1]; ++i )
+		  parallel_moves[i]->Move();
+	 }
+}
+
+unsigned int World::GetEventQueue( Model* mod )
 {
   if( worker_threads < 1 )
     return 0;
-  return( (random() % worker_threads) + 1);
+  
+  // deal the models out evenly. The workers share out the events at
+  // each update, so this is only a starting point.
+  const unsigned int q( next_event_queue % worker_threads + 1 );
+  ++next_event_queue;
+  return q;
+}
+
+point_int_t World::FiducialCell( const Pose& pose ) const
+{
+  return point_int_t( (int)floor( pose.x / fiducial_cell_size ),
+							 (int)floor( pose.y / fiducial_cell_size ) );
+}
+
+void World::FiducialInsert( Model* mod )
+{ 
+  FiducialErase( mod ); // make sure it's not there already
+  models_with_fiducials.push_back( mod ); 
+  
+  mod->fiducial_cell = FiducialCell( mod->GetGlobalPose() );
+  fiducial_grid[ FiducialHash( mod->fiducial_cell ) ].push_back( mod );
+}
+
+void World::FiducialErase( Model* mod )
+{ 
+  EraseAll( mod, models_with_fiducials );
+  EraseAll( mod, fiducial_grid[ FiducialHash( mod->fiducial_cell ) ] );
+}
+
+void World::FiducialRange( meters_t range )
+{
+  if( range <= fiducial_cell_size )
+	 return;
+  
+  fiducial_cell_size = range;
+  
+  // refile everything in the bigger cells
+  FOR_EACH( it, fiducial_grid )
+	 it->clear();
+  
+  FOR_EACH( it, models_with_fiducials )
+	 {
+		(*it)->fiducial_cell = FiducialCell( (*it)->GetGlobalPose() );
+		fiducial_grid[ FiducialHash( (*it)->fiducial_cell ) ].push_back( *it );
+	 }
+}
+
+void World::FiducialGridUpdate()
+{
+  FOR_EACH( it, models_with_fiducials )
+	 {
+		Model* mod( *it );
+		const point_int_t cell( FiducialCell( mod->GetGlobalPose() ) );
+		
+		if( cell == mod->fiducial_cell )
+		  continue;
+		
+		EraseAll( mod, fiducial_grid[ FiducialHash( mod->fiducial_cell ) ] );
+		fiducial_grid[ FiducialHash( cell ) ].push_back( mod );
+		mod->fiducial_cell = cell;
+	 }
+}
+
+void World::FiducialsNear( const Pose& pose, meters_t range, ModelPtrVec& found ) const
+{
+  const size_t start( found.size() );
+  
+  const point_int_t lo( FiducialCell( Pose( pose.x - range, pose.y - range, 0, 0 ) ) );
+  const point_int_t hi( FiducialCell( Pose( pose.x + range, pose.y + range, 0, 0 ) ) );
+  
+  if( (double)(hi.x - lo.x + 1) * (double)(hi.y - lo.y + 1) >= FIDUCIAL_BUCKETS )
+	 {
+		// it's quicker to look at everything
+		found.insert( found.end(), 
+						  models_with_fiducials.begin(), 
+						  models_with_fiducials.end() );
+	 }
+  else
+	 for( int x(lo.x); x<=hi.x; ++x )
+		for( int y(lo.y); y<=hi.y; ++y )
+		  {
+			 const ModelPtrVec& bucket( fiducial_grid[ FiducialHash( point_int_t( x, y ) ) ] );
+			 found.insert( found.end(), bucket.begin(), bucket.end() );
+		  }
+  
+  // several cells can share a bucket, so there may be duplicates
+  std::sort( found.begin() + start, found.end() );
+  found.erase( std::unique( found.begin() + start, found.end() ), found.end() );
 }
 
 Model* World::GetModel( const std::string& name ) const
@@ -726,14 +1605,112 @@ void World::Raytrace( const Pose &gpose, // global pose
 							 const uint32_t sample_count, // number of samples
 							 const bool ztest ) 
 {
+  RaytraceFan( Ray( model, gpose, range, func, arg, ztest ), 
+					fov, samples, sample_count );
+}
+
+void World::FanDirections( const radians_t fov,
+									 const uint32_t sample_count,
+									 std::vector<point_t>& dirs )
+{
+  dirs.resize( sample_count );
+  
+  // the same angles as RaytraceFan() gives the rays, less the heading
+  for( uint32_t s(0); s < sample_count; ++s )
+	 {
+		const double a( sample_count > 1 ? 
+							 (s * fov / (double)(sample_count-1)) - fov/2.0 : 0.0 );
+		dirs[s] = point_t( cos(a), sin(a) );
+	 }
+}
+
+void World::RaytraceFan( const Ray& r, 
+								 const radians_t fov,
+								 RaytraceResult* samples, // preallocated storage for samples
+								 const uint32_t sample_count, // number of samples
+								 const point_t* dirs ) // directions of the samples, or NULL
+{
+  if( sample_count < 1 )
+	 return;
+
   // find the direction of the first ray
-  Pose raypose( gpose );
-  const double starta( fov/2.0 - raypose.a );
+  Ray ray( r );
+  const double starta( fov/2.0 - r.origin.a );
+
+  // every ray in the fan starts in the same cell, so test that cell's
+  // blocks once here instead of once per ray
+  const unsigned int layer( (updates+1) % 2 );
+  const unsigned int layers[2] = { STATIC_LAYER, layer };
+  const double globx( r.origin.x * ppm );
+  const double globy( r.origin.y * ppm );
+
+  SuperRegion* sr( GetSuperRegion(point_int_t(GETSREG(globx),GETSREG(globy))));
+  Region* reg( sr ? sr->GetRegion(GETREG(globx),GETREG(globy)) : NULL );
+
+  bool skip_origin( false );
+	 
+  if( reg && reg->count ) 
+	 {
+		Cell* c( &reg->cells[ GETCELL(globx) + GETCELL(globy) * REGIONWIDTH ] );
+		
+		for( unsigned int l(0); l<2; ++l )
+		  FOR_EACH( it, c->blocks[layers[l]] )
+			 {	      	      
+				Block* block( *it );
+				
+				// skip if not in the right z range
+				if( r.ztest && 
+					 ( r.origin.z < block->global_z.min || 
+						r.origin.z > block->global_z.max ) )
+				  continue; 
+				
+				if( (*r.func)( block->mod, (Model*)r.mod, r.arg )) 
+				  {
+					 // every ray in the fan hits this block at zero range
+					 for( uint32_t s(0); s < sample_count; ++s )
+						{
+						  if( sample_count > 1 )
+							 ray.origin.a = (s * fov / (double)(sample_count-1)) - starta;
+						  
+						  samples[s] = RaytraceResult( ray.origin, 0 );
+						  samples[s].color = block->GetColor();
+						  samples[s].mod = block->mod;
+						}
+					 return;
+				  }
+			 }
+		
+		// nothing in the origin cell matched, so no ray needs to look
+		// at it again
+		skip_origin = true;
+	 }
+
+  if( dirs == NULL )
+	 {
+		for( uint32_t s(0); s < sample_count; ++s )
+		  {
+			 if( sample_count > 1 )
+				ray.origin.a = (s * fov / (double)(sample_count-1)) - starta;
+			 
+			 samples[s] = TraceRay( ray, skip_origin );
+		  }
+		return;
+	 }
+  
+  // rotate each direction by the heading of the fan, instead of
+  // finding the cosine and sine of each ray's angle
+  const double cosheading( cos(r.origin.a) );
+  const double sinheading( sin(r.origin.a) );
   
   for( uint32_t s(0); s < sample_count; ++s )
     {
-      raypose.a = (s * fov / (double)(sample_count-1)) - starta;
-      samples[s] = Raytrace( raypose, range, func, model, arg, ztest );
+		if( sample_count > 1 )
+		  ray.origin.a = (s * fov / (double)(sample_count-1)) - starta;
+		
+		samples[s] = TraceRay( ray, 
+									  cosheading * dirs[s].x - sinheading * dirs[s].y,
+									  sinheading * dirs[s].x + cosheading * dirs[s].y,
+									  skip_origin );
     }
 }
 
@@ -750,6 +1727,19 @@ RaytraceResult World::Raytrace( const Pose &gpose,
 
 
 RaytraceResult World::Raytrace( const Ray& r )
+{
+  return TraceRay( r, false );
+}
+
+RaytraceResult World::TraceRay( const Ray& r, const bool skip_origin )
+{
+  // eliminate a potential divide by zero
+  const double angle( r.origin.a == 0.0 ? 1e-12 : r.origin.a );
+  return TraceRay( r, cos(angle), sin(angle), skip_origin );
+}
+
+RaytraceResult World::TraceRay( const Ray& r, double cosa, double sina, 
+										  const bool skip_origin )
 {
   //rt_cells.clear();
   //rt_candidate_cells.clear();
@@ -765,10 +1755,9 @@ RaytraceResult World::Raytrace( const Ray& r )
   const double startx( globx );
   const double starty( globy );
   
-  // eliminate a potential divide by zero
-  const double angle( r.origin.a == 0.0 ? 1e-12 : r.origin.a );
-  const double cosa(cos(angle));
-  const double sina(sin(angle));
+  // eliminate a potential divide by zero, as above
+  if( sina == 0.0 ) sina = 1e-12;
+  if( cosa == 0.0 ) cosa = 1e-12;
   const double tana(sina/cosa); // = tan(angle)
 
   // the x and y components of the ray (these need to be doubles, or a
@@ -798,6 +1787,9 @@ RaytraceResult World::Raytrace( const Ray& r )
   const double yjumpdist( fabs(yjumpx)+fabs(yjumpy) );
 
   const unsigned int layer( (updates+1) % 2 );
+
+  // the static layer is tested first, then the moving layer
+  const unsigned int layers[2] = { STATIC_LAYER, layer };
   
   // these are updated as we go along the ray
   double xcrossx(0), xcrossy(0);
@@ -805,12 +1797,26 @@ RaytraceResult World::Raytrace( const Ray& r )
   double distX(0), distY(0);
   bool calculatecrossings( true );
 
+  // the superregion we are in, cached per ray rather than in the
+  // world since many threads trace rays at once. Around 99% of the
+  // time it is the same as the last lookup.
+  SuperRegion* sr( NULL );
+
+  // the origin cell has already been tested by the caller, so the
+  // walk takes its first step without looking at it again. The step
+  // is taken in the cell coordinates of the first region, since a
+  // coordinate just below zero is in the same cell as one just above.
+  bool skip( skip_origin );
+
   // Stage spends up to 95% of its time in this loop! It would be
   // neater with more function calls encapsulating things, but even
   // inline calls have a noticeable (2-3%) effect on performance.
   while( n > 0  ) // while we are still not at the ray end
     { 
-			SuperRegion* sr( GetSuperRegion(point_int_t(GETSREG(globx),GETSREG(globy))));
+			const point_int_t sup( GETSREG(globx), GETSREG(globy) );
+			if( sr == NULL || !(sr->GetOrigin() == sup) )
+			  sr = GetSuperRegion( sup );
+
 			Region* reg( sr ?	sr->GetRegion(GETREG(globx),GETREG(globy)) : NULL );
 			
       if( reg && reg->count ) // if the region contains any objects
@@ -825,41 +1831,112 @@ RaytraceResult World::Raytrace( const Ray& r )
 			 int32_t cx( GETCELL(globx) ); 
 			 int32_t cy( GETCELL(globy) );
 
-			 //Cell* c = reg->GetCell(cx,cy);
-			 Cell* c( &reg->cells[ cx + cy * REGIONWIDTH ] );
-			 assert(c); // should be good: we know the region contains objects
+			 if( skip )
+				{
+				  skip = false;
+				  if( exy < 0 ) 
+					 {
+						globx += sx;
+						exy += by;						
+						cx += sx;
+					 }
+				  else
+					 {
+						globy += sy;
+						exy -= bx;						
+						cy += sy;
+					 }
+				  --n;
+				}
+
+			 // bitmaps of the occupied cells in this region, so we
+			 // only touch the cells that contain blocks
+			 const uint32_t* rows( reg->GetOccupancy( layer ) );
+			 const uint32_t* static_rows( reg->GetOccupancy( STATIC_LAYER ) );
+
+			 // if there is a distance field, step over the cells it
+			 // says are empty, as long as it says there are some. It
+			 // knows nothing of moving blocks, so don't use it if
+			 // there are any here. Skipping the origin cell above can
+			 // have left us outside the region already.
+			 const uint8_t* clear( reg->occupied[layer] ? NULL : reg->clearance );
+			 while( clear && n > 0 &&
+					  (cx>=0) && (cx<REGIONWIDTH) && 
+					  (cy>=0) && (cy<REGIONWIDTH) )
+				{
+				  // there are no static blocks in the next clearance-1
+				  // cells along the ray, so take that many steps at once
+				  int32_t k( std::min( (int32_t)clear[ (cx >> CLEARBITS) + (cy >> CLEARBITS) * CLEARWIDTH ] - 1, n ) );
+				  
+				  // but stay in the region, taking at most xroom steps
+				  // along X and yroom along Y
+				  const int32_t xroom( sx > 0 ? REGIONWIDTH-1-cx : sx < 0 ? cx : REGIONWIDTH );
+				  const int32_t yroom( sy > 0 ? REGIONWIDTH-1-cy : sy < 0 ? cy : REGIONWIDTH );
+				  if( k > std::min( xroom, yroom ) )
+					 {
+						const int32_t xlimit( xroom * (bx + by) + exy );
+						const int32_t ylimit( (yroom + 1) * (bx + by) - bx - exy - 1 );
+						if( bx ) k = std::min( k, xlimit < 0 ? 0 : xlimit / bx + 1 );
+						if( by ) k = std::min( k, ylimit < 0 ? 0 : ylimit / by );
+					 }
+				  
+				  if( k <= 0 )
+					 break;
+				  
+				  // the number of those steps the walk below would take
+				  // along X: the least i with i*(bx+by) >= (k-1)*bx - exy
+				  const int32_t num( (k - 1) * bx - exy );
+				  const int32_t i( num > 0 ? (num + bx + by - 1) / (bx + by) : 0 );
+				  const int32_t j( k - i );
+				  
+				  // add the steps one at a time, as the walk does, since
+				  // adding them at once can round globx differently when
+				  // it has a fraction
+				  for( int32_t a(0); a<i; ++a ) globx += sx;
+				  for( int32_t a(0); a<j; ++a ) globy += sy;
+				  cx += sx * i;
+				  cy += sy * j;
+				  exy += i * by - j * bx;
+				  n -= k;
+				}
 
 			 // while within the bounds of this region and while some ray remains
-			 // we'll tweak the cell pointer directly to move around quickly
 			 while( (cx>=0) && (cx<REGIONWIDTH) && 
 					  (cy>=0) && (cy<REGIONWIDTH) && 
 					  n > 0 )
 				{			 
-				  FOR_EACH( it, c->blocks[layer] )
-					 {	      	      
-						Block* block( *it );
-						assert( block );
-
-						// skip if not in the right z range
-						if( r.ztest && 
-							 ( r.origin.z < block->global_z.min || 
-								r.origin.z > block->global_z.max ) )
-						  continue; 
-									
-						// test the predicate we were passed
-						if( (*r.func)( block->mod, (Model*)r.mod, r.arg )) 
-						  {
-							 // a hit!
-							 sample.color = block->GetColor();
-							 sample.mod = block->mod;
-											
-							 if( ax > ay ) // faster than the equivalent hypot() call
-								sample.range = fabs((globx-startx) / cosa) / ppm;
-							 else
-								sample.range = fabs((globy-starty) / sina) / ppm;
-											
-							 return sample;
-						  }				  
+				  if( (rows[cy] | static_rows[cy]) & (1U << cx) ) // the cell contains blocks
+					 {
+						//Cell* c = reg->GetCell(cx,cy);
+						Cell* c( &reg->cells[ cx + cy * REGIONWIDTH ] );
+
+						for( unsigned int l(0); l<2; ++l )
+						  FOR_EACH( it, c->blocks[layers[l]] )
+							 {	      	      
+								Block* block( *it );
+								assert( block );
+								
+								// skip if not in the right z range
+								if( r.ztest && 
+									 ( r.origin.z < block->global_z.min || 
+										r.origin.z > block->global_z.max ) )
+								  continue; 
+								
+								// test the predicate we were passed
+								if( (*r.func)( block->mod, (Model*)r.mod, r.arg )) 
+								  {
+									 // a hit!
+									 sample.color = block->GetColor();
+									 sample.mod = block->mod;
+									 
+									 if( ax > ay ) // faster than the equivalent hypot() call
+										sample.range = fabs((globx-startx) / cosa) / ppm;
+									 else
+										sample.range = fabs((globy-starty) / sina) / ppm;
+									 
+									 return sample;
+								  }				  
+							 }
 					 }
 
 				  // increment our cell in the correct direction
@@ -867,14 +1944,12 @@ RaytraceResult World::Raytrace( const Ray& r )
 					 {
 						globx += sx; // global coordinate
 						exy += by;						
-						c += sx; // move the cell left or right
 						cx += sx; // cell coordinate for bounds checking
 					 }
 				  else  // we're iterating along Y
 					 {
 						globy += sy; // global coordinate
 						exy -= bx;						
-						c += sy * REGIONWIDTH; // move the cell up or down
 						cy += sy; // cell coordinate for bounds checking
 					 }			 
 				  --n; // decrement the manhattan distance remaining
@@ -885,6 +1960,9 @@ RaytraceResult World::Raytrace( const Ray& r )
 		  }							 
       else // jump over the empty region
 		  {		  		  		  
+			 // there were no blocks in the origin cell to skip
+			 skip = false;
+
 			 // on the first run, and when we've been iterating over
 			 // cells, we need to calculate the next crossing of a region
 			 // boundary along each axis
@@ -980,6 +2058,17 @@ bool World::Save( const char *filename )
   return this->wf->Save( filename );
 }
 
+bool World::Compile()
+{
+  if( wf == NULL )
+	 {
+		PRINT_ERR( "no world loaded to compile" );
+		return false;
+	 }
+
+  return wf->Compile();
+}
+
 static int _reload_cb(  Model* mod, void* dummy )
 {
   mod->Load();
@@ -992,9 +2081,149 @@ void World::Reload( void )
   ForEachDescendant( _reload_cb, NULL );
 }
 
-void World::MapPoly( const PointIntVec& pts, Block* block, unsigned int layer )
+/** A horizontal run of cells [x0,x1] in row y, in global cell
+		coordinates. Used to merge the outline and interior of a filled
+		polygon before mapping it. */
+class CellRun
+{
+public:
+  int32_t y, x0, x1;
+  
+  CellRun( int32_t y, int32_t x0, int32_t x1 ) : y(y), x0(x0), x1(x1) {}
+  
+  bool operator<( const CellRun& other ) const
+  { return( y < other.y || (y == other.y && x0 < other.x0 )); }
+};
+
+/** Append the runs of cells on the outline of the polygon of pt_count
+		points at pts, and inside it if fill is true. */
+static void poly_runs( const point_int_t* pts, size_t pt_count, bool fill,
+											 std::vector<CellRun>& runs )
+{
+	// the outline, rasterized exactly as in MapPoly()
+	for( size_t i(0); i<pt_count; ++i )
+		{
+			const point_int_t& start(pts[i] );
+			const point_int_t& end(pts[(i+1)%pt_count]);
+			
+			const int32_t dx( end.x - start.x );
+			const int32_t dy( end.y - start.y );
+			const int32_t sx(sgn(dx));  
+			const int32_t sy(sgn(dy));  
+			const int32_t bx(2*abs(dx));	
+			const int32_t by(2*abs(dy));	 
+			int32_t exy(abs(dy)-abs(dx)); 
+			int32_t n(abs(dx)+abs(dy));
+			
+			int32_t x(start.x), y(start.y);
+			CellRun run( y, x, x );
+			bool open(false);
+			
+			// visit the same cells as the edge walk in MapPoly()
+			while( n ) 
+				{
+					if( open )
+						{
+							run.x0 = std::min( run.x0, x );
+							run.x1 = std::max( run.x1, x );
+						}
+					else
+						{
+							run = CellRun( y, x, x );
+							open = true;
+						}
+					
+					if( exy < 0 ) 
+						{
+							x += sx;
+							exy += by;
+						}
+					else // into the next row
+						{
+							runs.push_back( run );
+							open = false;
+							y += sy;
+							exy -= bx; 
+						}
+					--n;
+				}
+			
+			if( open )
+				runs.push_back( run );
+		}
+	
+	// the interior, sampled at the cell centers
+	if( ! fill )
+		return;
+	
+	int32_t miny( pts[0].y ), maxy( pts[0].y );
+	for( size_t i(1); i<pt_count; ++i )
+		{
+			miny = std::min( miny, pts[i].y );
+			maxy = std::max( maxy, pts[i].y );
+		}
+	
+	std::vector<double> xs;
+	for( int32_t y(miny); y<maxy; ++y )
+		{
+			const double cy( y + 0.5 );
+			xs.clear();
+			
+			for( size_t i(0); i<pt_count; ++i )
+				{
+					const point_int_t& a(pts[i] );
+					const point_int_t& b(pts[(i+1)%pt_count]);
+					
+					if( (a.y <= cy) != (b.y <= cy) ) // edge crosses this row
+						xs.push_back( a.x + (cy - a.y) * (b.x - a.x) / (double)(b.y - a.y) );
+				}
+			
+			std::sort( xs.begin(), xs.end() );
+			
+			for( size_t i(0); i+1 < xs.size(); i+=2 )
+				{
+					const int32_t x0( (int32_t)ceil( xs[i] - 0.5 ) );
+					const int32_t x1( (int32_t)floor( xs[i+1] - 0.5 ) );
+					if( x0 <= x1 )
+						runs.push_back( CellRun( y, x0, x1 ) );
+				}
+		}
+}
+
+void World::MapPolys( const PointIntVec& pts, size_t poly_size, Block* block, unsigned int layer, bool fill )
+{
+	// Find the runs of cells in each row covered by the polygons,
+	// then merge them so that each cell is mapped only once.
+	std::vector<CellRun> runs;
+	for( size_t first(0); poly_size && first+poly_size <= pts.size(); first += poly_size )
+		poly_runs( &pts[first], poly_size, fill, runs );
+	
+	// merge overlapping and adjacent runs in each row, and map them
+	std::sort( runs.begin(), runs.end() );
+	
+	for( size_t i(0); i<runs.size(); )
+		{
+			CellRun run( runs[i++] );
+			
+			while( i<runs.size() && 
+						 runs[i].y == run.y && 
+						 runs[i].x0 <= run.x1 + 1 )
+				run.x1 = std::max( run.x1, runs[i++].x1 );
+			
+			MapSpan( run.x0, run.x1, run.y, block, layer );
+		}
+}
+
+void World::MapPoly( const PointIntVec& pts, Block* block, unsigned int layer, bool fill )
 {
   const size_t pt_count( pts.size() );
+
+  if( fill )
+		{
+			// Scanline fill, mapping each cell only once
+			MapPolys( pts, pt_count, block, layer, true );
+			return;
+		}
   
   for( size_t i(0); i<pt_count; ++i )
 		{
@@ -1036,6 +2265,9 @@ void World::MapPoly( const PointIntVec& pts, Block* block, unsigned int layer )
 					// directly, because the region allocates cells lazily, waiting
 					// for a call of this method
 					Cell* c( reg->GetCell( cx, cy ) );
+
+					// the run of cells in the current row
+					CellSpan span( c, 0 );
 					
 					// while inside the region, manipulate the Cell pointer directly
 					while( (cx>=0) && (cx<REGIONWIDTH) && 
@@ -1043,6 +2275,10 @@ void World::MapPoly( const PointIntVec& pts, Block* block, unsigned int layer )
 								 n > 0 )
 						{					
 							c->AddBlock(block, layer ); 
+
+							if( c < span.start ) 
+								span.start = c;
+							++span.count;
 							
 							// cleverly skip to the next cell (now it's safe to
 							// manipulate the cell pointer)
@@ -1059,13 +2295,43 @@ void World::MapPoly( const PointIntVec& pts, Block* block, unsigned int layer )
 									exy -= bx; 
 									c += sy * REGIONWIDTH;
 									cy += sy;
+
+									// moving to another row ends the run
+									block->rendered_spans[layer].push_back( span );
+									span = CellSpan( c, 0 );
 								}
 							--n;
 						}
+
+					if( span.count )
+						block->rendered_spans[layer].push_back( span );
 				}			
 		}
 }
 
+void World::MapSpan( int32_t x0, int32_t x1, int32_t y, Block* block, unsigned int layer )
+{
+  const int32_t cy( GETCELL(y) );
+
+  // split the run at region boundaries
+  while( x0 <= x1 )
+		{
+			Region* reg( GetSuperRegionCreate( point_int_t(GETSREG(x0), GETSREG(y)))
+									 ->GetRegion( GETREG(x0), GETREG(y)));
+			assert(reg);
+
+			const int32_t cx( GETCELL(x0) );
+			const int32_t count( std::min( x1 - x0 + 1, REGIONWIDTH - cx ) );
+			
+			Cell* c( reg->GetCell( cx, cy ) );
+			for( int32_t i(0); i<count; ++i )
+				c[i].AddBlock( block, layer );
+			
+			block->rendered_spans[layer].push_back( CellSpan( c, count ) );
+			x0 += count;
+		}
+}
+
 
 SuperRegion* World::AddSuperRegion( const point_int_t& sup )
 {
@@ -1093,21 +2359,24 @@ SuperRegion* World::AddSuperRegion( const point_int_t& sup )
 
 inline SuperRegion* World::GetSuperRegion( const point_int_t& org )
 {
-  // around 99% of the time the SR is the same as last
-  // lookup - cache  gives a 4% overall speed up :)
-	
-  if( sr_cached && sr_cached->GetOrigin() == org )
-		return sr_cached;
-	
+  // this is called concurrently by worker threads, so it must not
+  // write to the world. Callers that look up the same superregion
+  // over and over, like the raytracer, keep their own cache.
   SuperRegion* sr(NULL);
   
-  // I despise some STL syntax sometimes...
-  std::map<point_int_t,SuperRegion*>::iterator it( superregions.find(org) );
+  SuperRegionGrid* grid( sr_grid );
+  SuperRegion** entry( grid ? grid->Entry( org ) : NULL );
   
-  if( it != superregions.end() )
-    sr = it->second;
-  
-  if( sr ) sr_cached = sr;
+  if( entry )
+	 sr = *entry;
+  else if( sr_grid_overflow ) // it might be one that could not be indexed
+	 {
+		// I despise some STL syntax sometimes...
+		std::map<point_int_t,SuperRegion*>::iterator it( superregions.find(org) );
+		
+		if( it != superregions.end() )
+		  sr = it->second;
+	 }
   
   return sr;
 }
@@ -1120,7 +2389,6 @@ inline SuperRegion* World::GetSuperRegionCreate( const point_int_t& org )
     {
       sr = AddSuperRegion( org );  
       assert( sr ); 
-      sr_cached = sr;
     }
   
   return sr;
@@ -1166,3 +2434,19 @@ bool World::Event::operator<( const Event& other ) const
   return( time > other.time );
 }
 
+bool World::Event::BatchLess( const Event& other ) const
+{
+  // events that can't be batched go first, in their original order
+  if( other.cb != Model::UpdateWrapper )
+	 return false;
+  if( cb != Model::UpdateWrapper )
+	 return true;
+  return( typeid(*mod).before( typeid(*other.mod) ) );
+}
+
+bool World::Event::SameBatch( const Event& other ) const
+{
+  return( cb == Model::UpdateWrapper && other.cb == Model::UpdateWrapper &&
+			 typeid(*mod) == typeid(*other.mod) );
+}
+
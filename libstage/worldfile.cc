@@ -57,6 +57,75 @@ using namespace Stg;
 #define PARSE_ERR(z, l)				\
   PRINT_ERR2("%s:%d : " z, this->filename.c_str(), l)
 
+///////////////////////////////////////////////////////////////////////////
+// Compiled world files
+
+// appended to the name of a world file to get the name of its
+// compiled form
+static const char* COMPILED_SUFFIX = ".compiled";
+
+// the first bytes of a compiled world file
+static const char COMPILED_MAGIC[8] = { 'S', 't', 'a', 'g', 'e', 'W', 'C', 0 };
+
+// increment this whenever the layout of compiled files changes
+static const uint32_t COMPILED_VERSION = 3;
+
+// written in the machine's byte order, so that files compiled on a
+// machine of the other order are rejected
+static const uint32_t COMPILED_BYTE_ORDER = 0x01020304;
+
+// Append the bytes of a value to a buffer
+template <class T>
+static void Put( std::string& buf, const T& value )
+{
+  buf.append( (const char*)&value, sizeof(value) );
+}
+
+// Append a string to a buffer, preceded by its length
+static void PutString( std::string& buf, const std::string& str )
+{
+  Put( buf, (uint32_t)str.size() );
+  buf.append( str );
+}
+
+// Reads values back from a compiled file in memory, noting if it
+// runs out of data
+class CompiledReader
+{
+public:
+  const char* pos;
+  const char* end;
+  bool ok; // false once we have tried to read past the end
+
+  CompiledReader( const char* pos, const char* end ) : 
+	 pos(pos), end(end), ok(true) {}
+
+  template <class T>
+  T Get()
+  {
+	 T value = T();
+	 if( ok && (size_t)(end - pos) >= sizeof(value) )
+		{
+		  memcpy( &value, pos, sizeof(value) );
+		  pos += sizeof(value);
+		}
+	 else
+		ok = false;
+	 return value;
+  }
+
+  std::string GetString()
+  {
+	 const uint32_t len( Get<uint32_t>() );
+	 if( ok && (size_t)(end - pos) >= len )
+		{
+		  pos += len;
+		  return std::string( pos - len, len );
+		}
+	 ok = false;
+	 return std::string();
+  }
+};
 
 ///////////////////////////////////////////////////////////////////////////
 // Default constructor
@@ -64,7 +133,9 @@ Worldfile::Worldfile() :
   tokens(),
   macros(),
   entities(),
-	properties(),
+	property_ids(),
+  sources(),
+  bitmaps(),
   filename(),
   unit_length( 1.0 ),
   unit_angle( M_PI / 180.0 )
@@ -134,23 +205,31 @@ bool Worldfile::Load(const std::string& filename )
       return false;
     }
 
-  ClearTokens();
-
-  // Read tokens from the file
-  if (!LoadTokens(file, 0))
+  // use the compiled form of the world if it is up to date, as it
+  // needs no parsing
+  if (LoadCompiled(this->filename + COMPILED_SUFFIX))
+    fclose(file);
+  else
     {
-      //DumpTokens();
-      fclose(file);
-      return false;
-    }
+      ClearTokens();
+      sources.push_back(this->filename);
 
-  fclose(file);
+      // Read tokens from the file
+      if (!LoadTokens(file, 0))
+	{
+	  //DumpTokens();
+	  fclose(file);
+	  return false;
+	}
 
-  // Parse the tokens to identify entities
-  if (!ParseTokens())
-    {
-      //DumpTokens();
-      return false;
+      fclose(file);
+
+      // Parse the tokens to identify entities
+      if (!ParseTokens())
+	{
+	  //DumpTokens();
+	  return false;
+	}
     }
 
   // Dump contents and exit if this file is meant for debugging only.
@@ -223,20 +302,275 @@ bool Worldfile::WarnUnused()
 {
 	bool unused = false;
 
-	FOR_EACH( it, properties )
-		{
-			if( ! it->second->used )
-				{
-					PRINT_WARN3("worldfile %s:%d : property [%s] is defined but not used",
-									this->filename.c_str(), it->second->line, it->second->name.c_str());
-					unused = true;
-				}
-		}
+	FOR_EACH( ent, entities )
+		FOR_EACH( it, ent->properties )
+			{
+				if( ! (*it)->used )
+					{
+						PRINT_WARN3("worldfile %s:%d : property [%s] is defined but not used",
+										this->filename.c_str(), (*it)->line, (*it)->name.c_str());
+						unused = true;
+					}
+			}
 	
 	return unused;
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// Save the parsed world in compiled form
+bool Worldfile::Compile()
+{
+  const std::string compiled(this->filename + COMPILED_SUFFIX);
+  std::string buf;
+
+  // the file couldn't be opened, so there's nothing to compile
+  if (sources.empty())
+    {
+      PRINT_ERR1("%s was not loaded, so it can't be compiled",
+		 this->filename.c_str());
+      return false;
+    }
+
+  buf.append(COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+  Put(buf, COMPILED_VERSION);
+  Put(buf, COMPILED_BYTE_ORDER);
+
+  // the files the world came from, with hashes of their contents so
+  // that we can tell if they change
+  Put(buf, (uint32_t)sources.size());
+  FOR_EACH( it, sources )
+    {
+      uint64_t hash;
+      if (!hash_file(*it, hash))
+	{
+	  PRINT_ERR2("unable to read %s : %s", it->c_str(), strerror(errno));
+	  return false;
+	}
+      PutString(buf, *it);
+      Put(buf, hash);
+    }
+
+  Put(buf, (uint32_t)tokens.size());
+  FOR_EACH( it, tokens )
+    {
+      Put(buf, (int32_t)it->include);
+      Put(buf, (int32_t)it->type);
+      PutString(buf, it->value);
+    }
+
+  // each entity's properties follow the entity
+  Put(buf, (uint32_t)entities.size());
+  FOR_EACH( it, entities )
+    {
+      Put(buf, (int32_t)it->parent);
+      PutString(buf, it->type);
+
+      Put(buf, (uint32_t)it->properties.size());
+      FOR_EACH( p, it->properties )
+	{
+	  const CProperty* property = *p;
+	  PutString(buf, property->name);
+	  Put(buf, (int32_t)property->line);
+	  Put(buf, (uint32_t)property->values.size());
+	  FOR_EACH( v, property->values )
+	    Put(buf, (int32_t)*v);
+	}
+    }
+
+  // the rectangles are only good for the way they were found
+  Put(buf, RECTS_VERSION);
+  Put(buf, RECTS_THRESHOLD);
+  Put(buf, (uint32_t)bitmaps.size());
+  FOR_EACH( it, bitmaps )
+    {
+      const CBitmap& bitmap = it->second;
+      uint64_t hash;
+      if (!hash_file(bitmap.filename, hash))
+	{
+	  PRINT_ERR2("unable to read %s : %s", bitmap.filename.c_str(), strerror(errno));
+	  return false;
+	}
+      PutString(buf, bitmap.filename);
+      Put(buf, hash);
+      Put(buf, (uint32_t)bitmap.width);
+      Put(buf, (uint32_t)bitmap.height);
+      Put(buf, (uint32_t)bitmap.rects.size());
+      FOR_EACH( v, bitmap.rects )
+	Put(buf, *v);
+    }
+
+  FILE *file = fopen(compiled.c_str(), "wb");
+  if (!file)
+    {
+      PRINT_ERR2("unable to open compiled world file %s : %s",
+		 compiled.c_str(), strerror(errno));
+      return false;
+    }
+
+  const bool written = (fwrite(buf.data(), 1, buf.size(), file) == buf.size());
+  if (fclose(file) != 0 || !written)
+    {
+      PRINT_ERR1("unable to write compiled world file %s", compiled.c_str());
+      remove(compiled.c_str());
+      return false;
+    }
+
+  printf("[Compiled %s]", compiled.c_str());
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Load the parsed world from a compiled file
+bool Worldfile::LoadCompiled(const std::string& filename)
+{
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (!file)
+    return false; // not compiled, which is fine
+
+  // read the whole file in one go
+  std::vector<char> data;
+  if (fseek(file, 0, SEEK_END) == 0)
+    {
+      const long size = ftell(file);
+      if (size > 0 && fseek(file, 0, SEEK_SET) == 0)
+	{
+	  data.resize(size);
+	  if (fread(&data[0], 1, size, file) != (size_t)size)
+	    data.clear();
+	}
+    }
+  fclose(file);
+
+  if (data.size() < sizeof(COMPILED_MAGIC) ||
+      memcmp(&data[0], COMPILED_MAGIC, sizeof(COMPILED_MAGIC)) != 0)
+    {
+      PRINT_WARN1("%s is not a compiled world file; ignoring it", filename.c_str());
+      return false;
+    }
+
+  CompiledReader in(&data[0] + sizeof(COMPILED_MAGIC), &data[0] + data.size());
+
+  if (in.Get<uint32_t>() != COMPILED_VERSION ||
+      in.Get<uint32_t>() != COMPILED_BYTE_ORDER)
+    {
+      PRINT_WARN1("compiled world file %s was made by a different version of Stage or on a different machine; ignoring it", 
+		  filename.c_str());
+      return false;
+    }
+
+  ClearProperties();
+  ClearEntities();
+  ClearTokens();
+  sources.clear();
+  bitmaps.clear();
+
+  bool stale = false;
+
+  for (uint32_t count = in.Get<uint32_t>(); in.ok && !stale && count > 0; --count)
+    {
+      const std::string source = in.GetString();
+      const uint64_t hash = in.Get<uint64_t>();
+      uint64_t current;
+      if (in.ok && !(hash_file(source, current) && current == hash))
+	stale = true;
+      sources.push_back(source);
+    }
+
+  for (uint32_t count = in.Get<uint32_t>(); in.ok && !stale && count > 0; --count)
+    {
+      const int include = in.Get<int32_t>();
+      const int type = in.Get<int32_t>();
+      AddToken(type, in.GetString().c_str(), include);
+    }
+
+  for (uint32_t count = in.Get<uint32_t>(); in.ok && !stale && count > 0; --count)
+    {
+      const int parent = in.Get<int32_t>();
+      const int entity = AddEntity(parent, in.GetString().c_str());
+
+      for (uint32_t props = in.Get<uint32_t>(); in.ok && props > 0; --props)
+	{
+	  const std::string name = in.GetString();
+	  const int line = in.Get<int32_t>();
+	  CProperty* property = AddProperty(entity, name.c_str(), line);
+
+	  const uint32_t values = in.Get<uint32_t>();
+	  for (uint32_t i = 0; in.ok && i < values; i++)
+	    {
+	      const int token = in.Get<int32_t>();
+	      if (token < 0 || token >= (int)tokens.size())
+		in.ok = false; // damaged
+	      else
+		AddPropertyValue(property, i, token);
+	    }
+	}
+    }
+
+  if (in.ok && !stale &&
+      (in.Get<uint32_t>() != RECTS_VERSION || in.Get<uint32_t>() != RECTS_THRESHOLD))
+    stale = true;
+
+  for (uint32_t count = in.Get<uint32_t>(); in.ok && !stale && count > 0; --count)
+    {
+      const std::string bitmapfile = in.GetString();
+      const uint64_t hash = in.Get<uint64_t>();
+      uint64_t current;
+      if (in.ok && !(hash_file(bitmapfile, current) && current == hash))
+	stale = true;
+
+      const uint32_t width = in.Get<uint32_t>();
+      const uint32_t height = in.Get<uint32_t>();
+      const uint32_t values = in.Get<uint32_t>();
+      if (!in.ok || (size_t)(in.end - in.pos) < values * sizeof(uint32_t))
+	{
+	  in.ok = false;
+	  break;
+	}
+
+      CBitmap bitmap(bitmapfile, width, height);
+      bitmap.rects.resize(values);
+      if (values)
+	memcpy(&bitmap.rects[0], in.pos, values * sizeof(uint32_t));
+      in.pos += values * sizeof(uint32_t);
+      AddBitmap(bitmap);
+    }
+
+  if (in.ok && !stale)
+    return true;
+
+  if (stale)
+    PRINT_WARN1("compiled world file %s is out of date; ignoring it", filename.c_str());
+  else
+    PRINT_WARN1("compiled world file %s is damaged; ignoring it", filename.c_str());
+
+  ClearProperties();
+  ClearEntities();
+  ClearTokens();
+  sources.clear();
+  bitmaps.clear();
+  return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Look up the rectangles of a bitmap
+const CBitmap* Worldfile::LookupBitmap( const std::string& filename )
+{
+  std::map<std::string,CBitmap>::iterator it = bitmaps.find( filename );
+  return( it == bitmaps.end() ? NULL : &it->second );
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Remember the rectangles of a bitmap
+void Worldfile::AddBitmap( const CBitmap& bitmap )
+{
+  bitmaps.insert( std::make_pair( bitmap.filename, bitmap ));
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Load tokens from a file.
 bool Worldfile::LoadTokens(FILE *file, int include)
@@ -513,6 +847,8 @@ bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
       return false;
     }
 
+  sources.push_back(fullpath);
+
   // Terminate the include line
   AddToken(TokenEOL, "\n", include);
 
@@ -740,8 +1076,8 @@ bool Worldfile::ParseTokens()
   int line;
   CToken *token;
 
-  ClearEntities();
   ClearProperties();
+  ClearEntities();
 
   // Add in the "global" entity.
   entity = AddEntity(-1, "");
@@ -1246,8 +1582,9 @@ void Worldfile::DumpEntities()
 {
   printf("\n## begin entities\n");
 
-	FOR_EACH( it, properties )
-		PrintProp( it->first.c_str(), it->second );
+	FOR_EACH( ent, entities )
+		FOR_EACH( it, ent->properties )
+			PrintProp( (*it)->name.c_str(), *it );
 
   printf("## end entities\n");
 }
@@ -1257,27 +1594,72 @@ void Worldfile::DumpEntities()
 // Clear the property list
 void Worldfile::ClearProperties()
 {
-	FOR_EACH( it, properties )
-		delete it->second;	
-	properties.clear();
+	FOR_EACH( ent, entities )
+		{
+			FOR_EACH( it, ent->properties )
+				delete *it;
+			ent->properties.clear();
+		}
+	property_ids.clear();
 }
 
 
+// orders an entity's properties by id, for std::lower_bound()
+static bool PropertyIdLess( const CProperty* property, int id )
+{
+  return( property->id < id );
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Add an property
 CProperty* Worldfile::AddProperty(int entity, const char *name, int line)
 {
-  char key[128];
-  snprintf( key, 127, "%d%s", entity, name );
+  assert( entity >= 0 && entity < (int)entities.size() );
 
-  CProperty *property = new CProperty( entity, name, line );
+  const int id = InternPropertyName( name );
+  CProperty *property = new CProperty( entity, id, name, line );
 
-	properties[ key ] = property;
+  // keep the entity's properties sorted by id. A property defined
+  // again replaces the old one.
+  std::vector<CProperty*>& props = entities[entity].properties;
+  std::vector<CProperty*>::iterator it = 
+	 std::lower_bound( props.begin(), props.end(), id, PropertyIdLess );
+  
+  if( it != props.end() && (*it)->id == id )
+	 {
+		delete *it;
+		*it = property;
+	 }
+  else
+	 props.insert( it, property );
 
 	return property;
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// Intern a property name
+int Worldfile::InternPropertyName(const char *name)
+{
+  std::map<std::string,int>::iterator it = property_ids.find( name );
+  if( it != property_ids.end() )
+	 return it->second;
+
+  const int id = property_ids.size();
+  property_ids[ name ] = id;
+  return id;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Look up the id of a property name
+int Worldfile::LookupPropertyId(const char *name)
+{
+  std::map<std::string,int>::const_iterator it = property_ids.find( name );
+  return( it == property_ids.end() ? -1 : it->second );
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Add an property value
 void Worldfile::AddPropertyValue( CProperty* property, int index, int value_token)
@@ -1298,28 +1680,22 @@ void Worldfile::AddPropertyValue( CProperty* property, int index, int value_toke
 // Get an property
 CProperty* Worldfile::GetProperty(int entity, const char *name)
 {
-  char key[128];
-  snprintf( key, 127, "%d%s", entity, name );
-  
-  //printf( "looking up key %s for entity %d name %s\n", key, entity, name );
-  
-  static char cache_key[128] = { 0 }; 
-  static CProperty* cache_property = NULL;
-  
-  if( strncmp( key, cache_key, 128 ) != 0 ) // different to last time
-	 {		
-		strncpy( cache_key, key, 128 ); // remember for next time		
-		
-		std::map<std::string,CProperty*>::iterator it = properties.find( key );	
-		if( it == properties.end() ) // not found
-		  cache_property = NULL;
-		else
-		  cache_property = it->second;		
-	 }
-  //else
-  // printf( "cache hit with %s\n", cache_key );
-	
-  return cache_property;
+  return GetPropertyById( entity, LookupPropertyId( name ) );
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Get an property by the id of its name
+CProperty* Worldfile::GetPropertyById(int entity, int id)
+{
+  if( entity < 0 || entity >= (int)entities.size() || id < 0 )
+	 return NULL;
+
+  const std::vector<CProperty*>& props = entities[entity].properties;
+  std::vector<CProperty*>::const_iterator it = 
+	 std::lower_bound( props.begin(), props.end(), id, PropertyIdLess );
+
+  return( it != props.end() && (*it)->id == id ? *it : NULL );
 }
 
 bool Worldfile::PropertyExists( int section, const char* token )
@@ -1346,7 +1722,8 @@ void Worldfile::SetPropertyValue( CProperty* property, int index, const char *va
 const char *Worldfile::GetPropertyValue(CProperty* property, int index)
 {
   assert(property);
-  property->used = true;
+  // several threads may read the same property at once
+  __atomic_store_n( &property->used, true, __ATOMIC_RELAXED );
   return GetTokenValue(property->values[index]);
 }
 
@@ -1539,12 +1916,13 @@ const char *Worldfile::ReadFilename(int entity, const char *name, const char *va
 
 
 ///////////////////////////////////////////////////////////////////////////
-// Read a string from a tuple
+// Read a string from a tuple. A tuple too short to have the value
+// reads as the default.
 const char *Worldfile::ReadTupleString(int entity, const char *name,
 				       int index, const char *value)
 {
   CProperty* property = GetProperty(entity, name);
-  if (property == NULL)
+  if (property == NULL || index >= (int)property->values.size())
     return value;
   return GetPropertyValue(property, index);
 }
@@ -1575,7 +1953,7 @@ double Worldfile::ReadTupleFloat(int entity, const char *name,
 				 int index, double value)
 {
   CProperty* property = GetProperty(entity, name);
-  if (property == NULL )
+  if (property == NULL || index >= (int)property->values.size())
     return value;
   return atof(GetPropertyValue(property, index));
 }
@@ -1603,7 +1981,7 @@ double Worldfile::ReadTupleLength(int entity, const char *name,
 				  int index, double value)
 {
   CProperty* property = GetProperty(entity, name);
-  if (property == NULL )
+  if (property == NULL || index >= (int)property->values.size())
     return value;
   return atof(GetPropertyValue(property, index)) * this->unit_length;
 }
@@ -1634,7 +2012,7 @@ double Worldfile::ReadTupleAngle(int entity, const char *name,
   //puts( name );
 
   CProperty* property = GetProperty(entity, name);
-  if (property == NULL)
+  if (property == NULL || index >= (int)property->values.size())
     return value;
   return atof(GetPropertyValue(property, index)) * this->unit_angle;
 }
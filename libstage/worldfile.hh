@@ -40,6 +40,9 @@ namespace Stg {
     /// Index of entity this property belongs to
     int entity;
 
+    /// Interned name of property, see Worldfile::LookupPropertyId()
+    int id;
+
     /// Name of property
 	 std::string name;
     
@@ -52,8 +55,9 @@ namespace Stg {
     /// Flag set if property has been used
     bool used;
 		
-	 CProperty( int entity, const char* name, int line ) :
+	 CProperty( int entity, int id, const char* name, int line ) :
 		entity(entity), 
+		id(id),
 		name(name),
 		values(),
 		line(line),
@@ -61,6 +65,29 @@ namespace Stg {
   };
 
 
+  /// The rectangles a bitmap was decomposed into, kept so that a
+  /// compiled world need not decode the bitmap again
+  class CBitmap
+  {
+  public:
+    /// Name of the bitmap file
+	 std::string filename;
+
+    /// Size of the bitmap in pixels
+	 unsigned int width, height;
+
+    /// Position and size of each rectangle in pixels, four values
+    /// (x, y, width, height) per rectangle
+	 std::vector<uint32_t> rects;
+
+	 CBitmap( const std::string& filename, unsigned int width, unsigned int height ) :
+		filename(filename),
+		width(width),
+		height(height),
+		rects() {}
+  };
+
+
   // Class for loading/saving world file.  This class hides the syntax
   // of the world file and provides an 'entity.property = value' style
   // interface.  Global settings go in entity 0; every other entity
@@ -85,6 +112,19 @@ namespace Stg {
 
 	 // Check for unused properties and print warnings
   public: bool WarnUnused();
+
+	 // Save the parsed world, and the rectangles of the bitmaps it
+	 // uses, in a compiled file that Load() reads instead of the world
+	 // file for as long as none of the files it came from change
+  public: bool Compile();
+
+	 // Get the rectangles a bitmap was decomposed into, or NULL if
+	 // they are not known
+  public: const CBitmap* LookupBitmap( const std::string& filename );
+
+	 // Remember the rectangles a bitmap was decomposed into, for
+	 // Compile()
+  public: void AddBitmap( const CBitmap& bitmap );
 	 
 	 // Read a string
   public: const std::string ReadString(int entity, const char* name, const std::string& value);
@@ -160,6 +200,10 @@ namespace Stg {
 	 ////////////////////////////////////////////////////////////////////////////
 	 // Private methods used to load stuff from the world file
   
+	 // Load the parsed world from a compiled file. Fails if the file
+	 // is missing, damaged, or older than any file it came from.
+  private: bool LoadCompiled(const std::string& filename);
+
 	 // Load tokens from a file.
   private: bool LoadTokens(FILE *file, int include);
 
@@ -266,10 +310,19 @@ namespace Stg {
   private: CProperty* AddProperty(int entity, const char *name, int line);
 	 // Add an property value.
   private: void AddPropertyValue( CProperty* property, int index, int value_token);
+
+	 // Get the id of a property name, adding it if it is new
+  private: int InternPropertyName(const char *name);
+
+	 // Get the id of a property name, or -1 if no property has the name
+  public: int LookupPropertyId(const char *name);
   
 	 // Get an property
   public: CProperty* GetProperty(int entity, const char *name);
 
+	 // Get an property by the id of its name
+  public: CProperty* GetPropertyById(int entity, int id);
+
 	 // returns true iff the property exists in the file, so that you can
 	 // be sure that GetProperty() will work
 	 bool PropertyExists( int section, const char* token );
@@ -355,15 +408,26 @@ namespace Stg {
 		
 		// Type of entity (i.e. position, laser, etc).
 		std::string type;
+
+		// Properties of the entity, sorted by id
+		std::vector<CProperty*> properties;
 		
-		CEntity( int parent, const char* type ) : parent(parent), type(type) {} 
+		CEntity( int parent, const char* type ) : parent(parent), type(type), properties() {} 
 	 };
 	 
 	 // Entity list
   private: std::vector<CEntity> entities;
 	 
-	 // Property list
-  private: std::map<std::string,CProperty*> properties;	
+	 // Ids of the property names, which are interned while parsing so
+	 // that looking a property up needs no string formatting, and
+	 // changes nothing, so it is safe from many threads at once
+  private: std::map<std::string,int> property_ids;
+
+	 // Files the world was read from: the world file and its includes
+  private: std::vector<std::string> sources;
+
+	 // Bitmaps decomposed into rectangles, by file name
+  private: std::map<std::string,CBitmap> bitmaps;
 	 
 	 // Name of the file we loaded
   public: std::string filename;
@@ -435,6 +435,7 @@ void WorldGui::DrawOccupancy() const
 	 {
 		it->second->DrawOccupancy(0);
 		it->second->DrawOccupancy(1);
+		it->second->DrawOccupancy(STATIC_LAYER);
 	 }
 }
 
@@ -443,7 +444,10 @@ void WorldGui::DrawVoxels() const
   unsigned int layer( updates % 2 );
 
   FOR_EACH( it, superregions )
+	 {
 		it->second->DrawVoxels( layer );
+		it->second->DrawVoxels( STATIC_LAYER );
+	 }
 }
 
 void WorldGui::windowCb( Fl_Widget* w, WorldGui* wg )
@@ -0,0 +1,289 @@
+/////////////////////////////////
+// File: raycompare.cc
+// Desc: Traces the same rays through a world with the reference
+//       raytracer and with a candidate, and checks that they agree
+// License: GPL
+/////////////////////////////////
+
+/* Usage: raycompare <candidate> <worldfile>
+
+	The reference traces each ray on its own with World::Raytrace(),
+	in double precision and without the distance field. The rays are a
+	full circle fan from every model in the world, and random rays
+	across it. The candidates are:
+
+	fan       trace each fan with World::RaytraceFan() and directions
+	          from World::FanDirections(), as rangers do
+	distance  step over empty cells with the distance field
+	fan_distance
+	          trace each fan as fan does, with the distance field, so
+	          that each ray steps from the cell after the fan's origin
+	dump      print the reference result of every ray, then run the
+	          world for a while and print every model's pose and
+	          ranger, fiducial and blobfinder output
+
+	Exits with status 0 if the candidate agrees with the reference.
+
+	The dump is exact, so two builds can be compared by diffing their
+	dumps, e.g. a build configured with
+	CMAKE_CXX_FLAGS="-march=native -ffp-contract=off" against a
+	default one. Without -ffp-contract=off the compiler may fuse
+	multiplies and adds, which rounds differently.
+
+	  raycompare dump simple.world > default.txt
+	  native/tests/raytrace/raycompare dump simple.world > native.txt
+	  diff default.txt native.txt
+
+	The order in which several threads update models can change the
+	outcome from run to run, so compare worlds updated by one thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+static const uint32_t FAN_SAMPLES = 361;
+static const meters_t FAN_RANGE = 20.0;
+static const uint32_t RANDOM_RAYS = 10000;
+static const uint32_t DUMP_UPDATES = 100;
+
+class Candidate
+{
+public:
+  const char* name;
+  meters_t tolerance; ///< how far a range may be from the reference
+  double outliers; ///< the fraction of rays that may be further, or hit another model
+};
+
+static const Candidate candidates[] = {
+  // rotating the directions changes the last bits of each ray's
+  // cosine and sine. That mostly moves a range by rounding, but a ray
+  // that is a whole number of cells long along an axis, or that grazes
+  // a cell corner, can go to either side of it. The bundled worlds
+  // have at most 1 such ray in 3000.
+  { "fan", 1e-9, 1e-3 },
+  // the field's steps land where the cell walk would have gone
+  { "distance", 0.0, 0.0 },
+  // as for fan, since the field's steps change nothing
+  { "fan_distance", 1e-9, 1e-3 },
+  { "dump", 0.0, 0.0 }
+};
+
+/** A fan of rays, or a single ray if samples is 1 */
+class Fan
+{
+public:
+  Pose pose;
+  Model* finder;
+  meters_t range;
+  radians_t fov;
+  uint32_t samples;
+
+  Fan( const Pose& pose, Model* finder, meters_t range, radians_t fov, uint32_t samples )
+	 : pose(pose), finder(finder), range(range), fov(fov), samples(samples)
+  {}
+};
+
+// hit anything but the model that is looking, like a ranger
+static bool match( Model* hit, Model* finder, const void* arg )
+{
+  (void)arg;
+  return( finder == NULL || ! hit->IsRelated( finder ) );
+}
+
+static void make_fans( World& world, std::vector<Fan>& fans )
+{
+  // in order of name, so that the rays are the same from run to run
+  std::map<std::string,Model*> byname;
+  const std::set<Model*> models( world.GetAllModels() );
+  FOR_EACH( it, models )
+	 byname[ (*it)->TokenStr() ] = *it;
+
+  FOR_EACH( it, byname )
+	 fans.push_back( Fan( it->second->GetGlobalPose(), it->second,
+								 FAN_RANGE, 2.0 * M_PI, FAN_SAMPLES ) );
+
+  // random rays long enough to cross the whole world
+  const bounds3d_t& ext( world.GetExtent() );
+  const meters_t range( hypot( ext.x.max - ext.x.min, ext.y.max - ext.y.min ) );
+
+  srand48( 0 );
+  for( uint32_t i(0); i<RANDOM_RAYS; ++i )
+	 fans.push_back( Fan( Pose::Random( ext.x.min, ext.x.max, ext.y.min, ext.y.max ),
+								 NULL, range, 0.0, 1 ) );
+}
+
+// trace each ray of the fan on its own, at the same angles as
+// World::RaytraceFan() gives them
+static void trace_each( World& world, const Fan& fan, RaytraceResult* samples )
+{
+  Ray ray( fan.finder, fan.pose, fan.range, match, NULL, false );
+
+  for( uint32_t s(0); s < fan.samples; ++s )
+	 {
+		if( fan.samples > 1 )
+		  ray.origin.a = (s * fan.fov / (double)(fan.samples-1)) - (fan.fov/2.0 - fan.pose.a);
+
+		samples[s] = world.Raytrace( ray );
+	 }
+}
+
+static void trace_fan( World& world, const Fan& fan, RaytraceResult* samples )
+{
+  std::vector<point_t> dirs;
+  World::FanDirections( fan.fov, fan.samples, dirs );
+
+  world.RaytraceFan( Ray( fan.finder, fan.pose, fan.range, match, NULL, false ),
+							fan.fov, samples, fan.samples, &dirs[0] );
+}
+
+static void trace( World& world,
+						 const std::vector<Fan>& fans,
+						 void (*func)( World&, const Fan&, RaytraceResult* ),
+						 std::vector<RaytraceResult>& results )
+{
+  FOR_EACH( fan, fans )
+	 {
+		const size_t first( results.size() );
+		results.resize( first + fan->samples );
+		(*func)( world, *fan, &results[first] );
+	 }
+}
+
+// print the state of every model after running the world, in order
+// of name and with the exact values
+static void dump_models( World& world )
+{
+  std::set<Model*> models( world.GetAllModels() );
+  FOR_EACH( it, models )
+	 (*it)->Subscribe();
+
+  for( uint32_t i(0); i<DUMP_UPDATES; ++i )
+	 world.Update();
+
+  std::map<std::string,Model*> byname;
+  models = world.GetAllModels();
+  FOR_EACH( it, models )
+	 byname[ (*it)->TokenStr() ] = *it;
+
+  FOR_EACH( it, byname )
+	 {
+		Model* mod( it->second );
+		const Pose pose( mod->GetGlobalPose() );
+		printf( "%s %a %a %a\n", it->first.c_str(), pose.x, pose.y, pose.a );
+
+		if( ModelRanger* ranger = dynamic_cast<ModelRanger*>( mod ) )
+		  {
+			 const std::vector<ModelRanger::Sensor>& sensors( ranger->GetSensors() );
+			 FOR_EACH( s, sensors )
+				{
+				  FOR_EACH( r, s->ranges )
+					 printf( " %a", *r );
+				  putchar( '\n' );
+				}
+		  }
+
+		if( ModelFiducial* fid = dynamic_cast<ModelFiducial*>( mod ) )
+		  FOR_EACH( f, fid->GetFiducials() )
+			 printf( " fiducial %d %a %a\n", f->id, f->range, f->bearing );
+
+		if( ModelBlobfinder* bf = dynamic_cast<ModelBlobfinder*>( mod ) )
+		  {
+			 const std::vector<ModelBlobfinder::Blob> blobs( bf->GetBlobs() );
+			 FOR_EACH( b, blobs )
+				printf( " blob %u %u %a\n", b->left, b->right, b->range );
+		  }
+	 }
+}
+
+int main( int argc, char* argv[] )
+{
+  const Candidate* cand( NULL );
+  for( size_t i(0); argc == 3 && i < sizeof(candidates)/sizeof(candidates[0]); ++i )
+	 if( strcmp( argv[1], candidates[i].name ) == 0 )
+		cand = &candidates[i];
+
+  if( cand == NULL )
+	 {
+		fprintf( stderr, "usage: %s <candidate> <worldfile>\ncandidates:", argv[0] );
+		for( size_t i(0); i < sizeof(candidates)/sizeof(candidates[0]); ++i )
+		  fprintf( stderr, " %s", candidates[i].name );
+		fputc( '\n', stderr );
+		return 2;
+	 }
+
+  const std::string worldfile( argv[2] );
+
+  Init( &argc, &argv );
+  srand48( 0 ); // Init() seeds with the time
+
+  World world;
+  world.Load( worldfile );
+
+  // rays look at the moving models in the layer they are mapped into
+  // by an update
+  world.Update();
+
+  std::vector<Fan> fans;
+  make_fans( world, fans );
+
+  std::vector<RaytraceResult> ref, out;
+  trace( world, fans, trace_each, ref );
+
+  const std::string name( cand->name );
+  if( name == "dump" )
+	 {
+		for( size_t i(0); i < ref.size(); ++i )
+		  printf( "%lu %a %a %s\n", (unsigned long)i, ref[i].pose.a, ref[i].range,
+					 ref[i].mod ? ref[i].mod->Token() : "-" );
+
+		dump_models( world );
+		return 0;
+	 }
+  else if( name == "fan" )
+	 trace( world, fans, trace_fan, out );
+  else if( name == "fan_distance" )
+	 {
+		world.SetDistanceField( true );
+		trace( world, fans, trace_fan, out );
+		world.SetDistanceField( false );
+	 }
+  else if( name == "distance" )
+	 {
+		world.SetDistanceField( true );
+		trace( world, fans, trace_each, out );
+		world.SetDistanceField( false );
+	 }
+
+  meters_t largest( 0 );
+  unsigned long outliers( 0 );
+  for( size_t i(0); i < ref.size(); ++i )
+	 {
+		const meters_t diff( fabs( out[i].range - ref[i].range ) );
+
+		if( diff > cand->tolerance || out[i].mod != ref[i].mod )
+		  {
+			 if( outliers++ < 10 )
+				printf( "  ray %lu from [%.3f %.3f] at %.6f: %.9f m hitting %s, expected %.9f m hitting %s\n",
+						  (unsigned long)i, ref[i].pose.x, ref[i].pose.y, ref[i].pose.a,
+						  out[i].range, out[i].mod ? out[i].mod->Token() : "nothing",
+						  ref[i].range, ref[i].mod ? ref[i].mod->Token() : "nothing" );
+		  }
+		else
+		  largest = std::max( largest, diff );
+	 }
+
+  const unsigned long allowed( (unsigned long)( cand->outliers * ref.size() ) );
+
+  const bool agree( outliers <= allowed );
+
+  printf( "%s: %s: %lu rays %s, largest difference %g m, %lu further than %g m or hitting another model (%lu allowed)\n",
+			 worldfile.c_str(), cand->name, (unsigned long)ref.size(),
+			 agree ? "agree" : "disagree",
+			 largest, outliers, cand->tolerance, allowed );
+
+  return( agree ? 0 : 1 );
+}